@@ -0,0 +1,431 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+// benchmark of LazyKdTree and StrictKdTree for several point distributions,
+// sizes and dimensions, see usage below
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "KdTree.h"
+
+using namespace std;
+using namespace lazyTrees;
+
+template <size_t D>
+class PointN
+{
+public:
+    double coords[D];
+
+    static constexpr size_t dimensions()
+    {
+        return D;
+    }
+
+    const double& operator[](size_t idx) const
+    {
+        return coords[idx];
+    }
+
+    double& operator[](size_t idx)
+    {
+        return coords[idx];
+    }
+};
+
+//------------------------------------------------------------------------------
+
+struct Options {
+    vector<size_t> sizes         = { 1000, 10000, 100000, 1000000 };
+    vector<size_t> dims          = { 2, 3, 8, 16 };
+    vector<string> distributions = { "uniform", "clustered", "surface", "duplicates", "collinear" };
+    size_t nQueries              = 1000;
+    size_t nRepetitions          = 5;
+    size_t k                     = 10; // also the expected number of points within sphere / box
+    string csv;
+};
+
+struct Result {
+    string distribution;
+    size_t size, dims;
+    string tree, action;
+    double median, p99;  // µs per query
+    double throughput;   // queries per second
+};
+
+//------------------------------------------------------------------------------
+
+template <size_t D>
+vector<PointN<D> > generate(string const& distribution, size_t n, mt19937& gen)
+{
+    uniform_real_distribution<double> uniform(0.0, 1.0);
+    normal_distribution<double> normal(0.0, 1.0);
+
+    vector<PointN<D> > pts(n);
+
+    if (distribution == "uniform") {
+        for (auto& p : pts)
+            for (size_t d = 0; d < D; ++d)
+                p[d] = uniform(gen);
+    } else if (distribution == "clustered") {
+        // gaussian clusters of different density
+        const size_t nClusters = 32;
+        vector<PointN<D> > centers(nClusters);
+        vector<double> sigmas(nClusters);
+        for (size_t c = 0; c < nClusters; ++c) {
+            for (size_t d = 0; d < D; ++d)
+                centers[c][d] = uniform(gen);
+            sigmas[c] = 0.002 + 0.03 * uniform(gen);
+        }
+        uniform_int_distribution<size_t> cluster(0, nClusters - 1);
+        for (auto& p : pts) {
+            const size_t c = cluster(gen);
+            for (size_t d = 0; d < D; ++d)
+                p[d] = centers[c][d] + sigmas[c] * normal(gen);
+        }
+    } else if (distribution == "surface") {
+        // like a scan of a terrain, all points lie close to a 2D height field
+        for (auto& p : pts) {
+            const double x = uniform(gen), y = uniform(gen);
+            p[0] = x;
+            p[1] = y;
+            if (D > 2)
+                p[2] = 0.1 * sin(12.0 * x) * cos(9.0 * y) + 0.001 * normal(gen);
+            for (size_t d = 3; d < D; ++d)
+                p[d] = 0.001 * normal(gen);
+        }
+    } else if (distribution == "duplicates") {
+        // every point exists about 100 times
+        const size_t nUnique = max<size_t>(1, n / 100);
+        vector<PointN<D> > unique(nUnique);
+        for (auto& p : unique)
+            for (size_t d = 0; d < D; ++d)
+                p[d] = uniform(gen);
+        uniform_int_distribution<size_t> pick(0, nUnique - 1);
+        for (auto& p : pts)
+            p = unique[pick(gen)];
+    } else if (distribution == "collinear") {
+        // sorted points on a line, as used by the old performance test
+        for (size_t i = 0; i < n; ++i)
+            for (size_t d = 0; d < D; ++d)
+                pts[i][d] = (d + 1) * double(i) / n;
+    } else {
+        throw invalid_argument("unknown distribution " + distribution);
+    }
+
+    return pts;
+}
+
+// searches close to random input points
+template <size_t D>
+vector<PointN<D> > generate_searches(vector<PointN<D> > const& pts, size_t n, mt19937& gen)
+{
+    uniform_int_distribution<size_t> pick(0, pts.size() - 1);
+    normal_distribution<double> normal(0.0, 0.001);
+
+    vector<PointN<D> > searches(n);
+    for (auto& s : searches) {
+        s = pts[pick(gen)];
+        for (size_t d = 0; d < D; ++d)
+            s[d] += normal(gen);
+    }
+    return searches;
+}
+
+//------------------------------------------------------------------------------
+
+typedef chrono::high_resolution_clock Clock;
+
+double elapsed_us(Clock::time_point start)
+{
+    return chrono::duration<double, micro>(Clock::now() - start).count();
+}
+
+double percentile(vector<double> values, double p)
+{
+    sort(values.begin(), values.end());
+    const size_t i = min(values.size() - 1, size_t(p * (values.size() - 1) + 0.5));
+    return values[i];
+}
+
+// times query(search) for every search, after an untimed call for every
+// search, which evaluates all parts of lazy trees the queries need
+// (measured separately as first queries)
+Result measure(Options const& options, size_t nSearches, function<void(size_t)> const& query)
+{
+    for (size_t i = 0; i < nSearches; ++i)
+        query(i);
+
+    vector<double> latencies;
+    latencies.reserve(nSearches * options.nRepetitions);
+
+    double total = 0.0;
+    for (size_t r = 0; r < options.nRepetitions; ++r) {
+        for (size_t i = 0; i < nSearches; ++i) {
+            const auto start = Clock::now();
+            query(i);
+            latencies.push_back(elapsed_us(start));
+            total += latencies.back();
+        }
+    }
+
+    Result res;
+    res.median     = percentile(latencies, 0.5);
+    res.p99        = percentile(latencies, 0.99);
+    res.throughput = latencies.size() / (total * 1e-6);
+    return res;
+}
+
+// single runs of actions which can't be repeated on the same tree
+Result measure_once(vector<double> const& latencies)
+{
+    Result res;
+    res.median     = percentile(latencies, 0.5);
+    res.p99        = percentile(latencies, 0.99);
+    double total = 0.0;
+    for (auto l : latencies)
+        total += l;
+    res.throughput = latencies.size() / (total * 1e-6);
+    return res;
+}
+
+//------------------------------------------------------------------------------
+
+template <size_t D>
+void run(Options const& options, string const& distribution, size_t size, vector<Result>& results)
+{
+    mt19937 gen(42);
+    const auto pts      = generate<D>(distribution, size, gen);
+    const auto searches = generate_searches<D>(pts, options.nQueries, gen);
+
+    // radius and box size with k points expected for uniform distributions
+    const double pi         = 3.14159265358979323846;
+    const double unitVolume = pow(pi, D / 2.0) / tgamma(D / 2.0 + 1.0);
+    const double radius     = pow(options.k / (size * unitVolume), 1.0 / D);
+    PointN<D> boxSize;
+    for (size_t d = 0; d < D; ++d)
+        boxSize[d] = pow(double(options.k) / size, 1.0 / D);
+
+    auto add = [&](string const& tree, string const& action, Result res) {
+        res.distribution = distribution;
+        res.size         = size;
+        res.dims         = D;
+        res.tree         = tree;
+        res.action       = action;
+        results.push_back(res);
+
+        cout << left
+             << setw(12) << distribution << setw(10) << size << setw(6) << D
+             << setw(8) << tree << setw(24) << action << right << fixed << setprecision(3)
+             << setw(14) << res.median << setw(14) << res.p99 << setw(18) << setprecision(1) << res.throughput
+             << endl;
+    };
+
+    // creation, a single run per repetition
+    vector<double> tLazy, tStrict;
+    for (size_t r = 0; r < options.nRepetitions; ++r) {
+        auto copy = pts;
+        auto start = Clock::now();
+        LazyKdTree<PointN<D> > lazy(std::move(copy));
+        tLazy.push_back(elapsed_us(start));
+
+        copy = pts;
+        start = Clock::now();
+        StrictKdTree<PointN<D> > strict(std::move(copy));
+        tStrict.push_back(elapsed_us(start));
+    }
+    add("lazy", "creation", measure_once(tLazy));
+    add("strict", "creation", measure_once(tStrict));
+
+    // evaluating a lazy tree fully, same as creating a strict one
+    vector<double> tEvaluate;
+    for (size_t r = 0; r < options.nRepetitions; ++r) {
+        LazyKdTree<PointN<D> > fresh(pts);
+        const auto start = Clock::now();
+        fresh.ensure_evaluated_fully();
+        tEvaluate.push_back(elapsed_us(start));
+    }
+    add("lazy", "evaluation", measure_once(tEvaluate));
+
+    // first queries on fresh lazy trees, these include the evaluation
+    auto first = [&](string const& action, function<void(LazyKdTree<PointN<D> >&, PointN<D> const&)> const& query) {
+        vector<double> tFirst;
+        LazyKdTree<PointN<D> > fresh(pts);
+        for (auto const& search : searches) {
+            const auto start = Clock::now();
+            query(fresh, search);
+            tFirst.push_back(elapsed_us(start));
+        }
+        add("lazy", action + " (first)", measure_once(tFirst));
+    };
+    first("nearest", [](LazyKdTree<PointN<D> >& tree, PointN<D> const& search) {
+        tree.nearest(search); });
+    first("k_nearest", [&](LazyKdTree<PointN<D> >& tree, PointN<D> const& search) {
+        tree.k_nearest(search, options.k); });
+    first("in_hypersphere", [&](LazyKdTree<PointN<D> >& tree, PointN<D> const& search) {
+        tree.in_hypersphere(search, radius); });
+    first("in_box", [&](LazyKdTree<PointN<D> >& tree, PointN<D> const& search) {
+        tree.in_box(search, boxSize); });
+
+    StrictKdTree<PointN<D> > strict(pts);
+    StrictKdTree<PointN<D>, 1, NoStats, SoA> soa(pts);
+    // leaf buckets, scanned by the SIMD kernels if LAZYTREES_SIMD_BUCKETS is defined
+    StrictKdTree<PointN<D>, 16, NoStats, SoA> soa16(pts);
+    LazyKdTree<PointN<D> > lazy(pts);
+
+    size_t sink = 0; // prevents the queries from being optimized away
+
+    add("lazy", "nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += lazy.nearest_index(searches[i]); }));
+    add("strict", "nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += strict.nearest_index(searches[i]); }));
+    add("soa", "nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += soa.nearest_index(searches[i]); }));
+    add("soa16", "nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += soa16.nearest_index(searches[i]); }));
+
+    add("lazy", "k_nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += lazy.k_nearest(searches[i], options.k).size(); }));
+    add("strict", "k_nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += strict.k_nearest(searches[i], options.k).size(); }));
+    add("soa", "k_nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += soa.k_nearest(searches[i], options.k).size(); }));
+    add("soa16", "k_nearest", measure(options, searches.size(), [&](size_t i) {
+        sink += soa16.k_nearest(searches[i], options.k).size(); }));
+
+    add("lazy", "in_hypersphere", measure(options, searches.size(), [&](size_t i) {
+        sink += lazy.in_hypersphere(searches[i], radius).size(); }));
+    add("strict", "in_hypersphere", measure(options, searches.size(), [&](size_t i) {
+        sink += strict.in_hypersphere(searches[i], radius).size(); }));
+    add("soa", "in_hypersphere", measure(options, searches.size(), [&](size_t i) {
+        sink += soa.in_hypersphere(searches[i], radius).size(); }));
+    add("soa16", "in_hypersphere", measure(options, searches.size(), [&](size_t i) {
+        sink += soa16.in_hypersphere(searches[i], radius).size(); }));
+
+    add("lazy", "in_box", measure(options, searches.size(), [&](size_t i) {
+        sink += lazy.in_box(searches[i], boxSize).size(); }));
+    add("strict", "in_box", measure(options, searches.size(), [&](size_t i) {
+        sink += strict.in_box(searches[i], boxSize).size(); }));
+    add("soa", "in_box", measure(options, searches.size(), [&](size_t i) {
+        sink += soa.in_box(searches[i], boxSize).size(); }));
+    add("soa16", "in_box", measure(options, searches.size(), [&](size_t i) {
+        sink += soa16.in_box(searches[i], boxSize).size(); }));
+
+    if (sink == 42)
+        cout << "";
+}
+
+//------------------------------------------------------------------------------
+
+template <typename T>
+vector<T> parse_list(string const& arg)
+{
+    vector<T> res;
+    stringstream ss(arg);
+    string item;
+    while (getline(ss, item, ',')) {
+        stringstream is(item);
+        T value;
+        is >> value;
+        res.push_back(value);
+    }
+    return res;
+}
+
+const char* const usage =
+    "usage: benchmark [--sizes 1000,100000] [--dims 2,3,8,16]\n"
+    "                 [--distributions uniform,clustered,surface,duplicates,collinear]\n"
+    "                 [--queries 1000] [--repetitions 5] [--csv results.csv]\n";
+
+// false for unknown keys, keys without value and unsupported dimensions or
+// distributions
+bool parse_options(int argc, char** argv, Options& options)
+{
+    if (argc % 2 == 0)
+        return false; // every key is followed by its value
+
+    for (int i = 1; i < argc; i += 2) {
+        const string key(argv[i]), value(argv[i + 1]);
+        if      (key == "--sizes")         options.sizes         = parse_list<size_t>(value);
+        else if (key == "--dims")          options.dims          = parse_list<size_t>(value);
+        else if (key == "--distributions") options.distributions = parse_list<string>(value);
+        else if (key == "--queries")       options.nQueries      = strtoul(value.c_str(), nullptr, 10);
+        else if (key == "--repetitions")   options.nRepetitions  = strtoul(value.c_str(), nullptr, 10);
+        else if (key == "--csv")           options.csv           = value;
+        else return false;
+    }
+
+    for (const auto dims : options.dims) {
+        if (dims != 2 && dims != 3 && dims != 8 && dims != 16)
+            return false;
+    }
+
+    const vector<string> known = Options().distributions; // all by default
+    for (auto const& distribution : options.distributions) {
+        if (find(known.begin(), known.end(), distribution) == known.end())
+            return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_options(argc, argv, options)) {
+        cerr << usage;
+        return 1;
+    }
+
+    cout << left
+         << setw(12) << "dist" << setw(10) << "size" << setw(6) << "dims"
+         << setw(8) << "tree" << setw(24) << "action" << right
+         << setw(14) << "median [us]" << setw(14) << "p99 [us]" << setw(18) << "throughput [1/s]"
+         << endl;
+
+    vector<Result> results;
+    for (auto const& distribution : options.distributions) {
+        for (const auto size : options.sizes) {
+            for (const auto dims : options.dims) {
+                switch (dims) {
+                    case 2:  run<2>(options, distribution, size, results);  break;
+                    case 3:  run<3>(options, distribution, size, results);  break;
+                    case 8:  run<8>(options, distribution, size, results);  break;
+                    case 16: run<16>(options, distribution, size, results); break;
+                    default: throw invalid_argument("supported dimensions are 2, 3, 8 and 16");
+                }
+            }
+        }
+    }
+
+    if (!options.csv.empty()) {
+        ofstream out(options.csv);
+        out << "distribution;size;dimensions;tree;action;median [us];p99 [us];throughput [1/s]" << endl;
+        for (auto const& r : results)
+            out << r.distribution << ";" << r.size << ";" << r.dims << ";" << r.tree << ";" << r.action << ";"
+                << r.median << ";" << r.p99 << ";" << r.throughput << endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef CONCURRENTLAZYKDTREE_H
+#define CONCURRENTLAZYKDTREE_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include "KdTree.h"
+#include "NodePool.h"
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+// lazy k-d tree which can be queried by several threads at once
+// the first thread reaching an unevaluated subtree evaluates it, while other
+// threads reaching the same subtree wait for it to finish
+// evaluated subtrees are never modified again, so they are read without locking
+// requirements of P are the same as for LazyKdTree
+template <typename P, size_t BucketSize = 1>
+class ConcurrentLazyKdTree {
+private:
+    friend class detail::KdSearch<P, BucketSize>;
+    friend class NearestIterator<P, BucketSize, const ConcurrentLazyKdTree>;
+
+    typedef detail::Range<P, BucketSize> Range;
+    typedef detail::KdSearch<P, BucketSize> Search;
+    typedef detail::Storage<P, AoS> Storage;
+    typedef typename Storage::Scalar Scalar;
+
+    // a slot either holds nullptr (unevaluated), the busy marker (currently
+    // being evaluated) or the published node (evaluated)
+    // nodes are created within the pool of the tree and released with it
+    struct Node {
+        std::atomic<Node*> childNegative, childPositive;
+    };
+
+    struct Cursor {
+        std::atomic<Node*>* node;
+        Range range;
+    };
+
+    mutable Storage storage;
+
+    // only the creation of nodes is locked, not the evaluation of their subtrees
+    mutable detail::NodePool<Node> nodes;
+    mutable std::mutex nodesMutex;
+
+    mutable std::atomic<Node*> root;
+
+    const size_t dim;
+
+//------------------------------------------------------------------------------
+
+public:
+    ConcurrentLazyKdTree(std::vector<P>&& in, int dimension = 0)
+        : storage(std::move(in))
+        , nodes()
+        , nodesMutex()
+        , root(nullptr)
+        , dim(dimension % PointTraits<P>::dimensions())
+    {
+      throw_if_input_empty();
+    }
+
+    ConcurrentLazyKdTree(std::vector<P> const& in, int dimension = 0)
+        : storage(in)
+        , nodes()
+        , nodesMutex()
+        , root(nullptr)
+        , dim(dimension % PointTraits<P>::dimensions())
+    {
+      throw_if_input_empty();
+    }
+
+    // moving is not thread-safe, no queries may run on other while moving
+    ConcurrentLazyKdTree(ConcurrentLazyKdTree&& other)
+        : storage(std::move(other.storage))
+        , nodes(std::move(other.nodes))
+        , nodesMutex()
+        , root(other.root.exchange(nullptr))
+        , dim(other.dim)
+    {}
+
+    ConcurrentLazyKdTree(ConcurrentLazyKdTree const&) = delete;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    inline void throw_if_input_empty() const
+    {
+      if (storage.size() == 0)
+        throw std::logic_error("ConcurrentLazyKdTree can't be constructed from empty inputs");
+    }
+
+    static inline Node* busy_marker()
+    {
+        static Node marker;
+        return &marker;
+    }
+
+    inline Node* create_node() const
+    {
+        std::lock_guard<std::mutex> lock(nodesMutex);
+        return nodes.create();
+    }
+
+    inline Cursor root_cursor() const
+    {
+        return Cursor{ &root, Range{ 0, storage.size(), dim } };
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return storage.point(position);
+    }
+
+    inline Scalar coordinate(size_t position, size_t dimension) const
+    {
+        return storage.coordinate(position, dimension);
+    }
+
+    inline Scalar const* coordinates(size_t dimension) const
+    {
+        return storage.coordinates(dimension);
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return storage.index(position);
+    }
+
+    // concurrent queries aren't observed
+    inline NoStats stats() const
+    {
+        return NoStats();
+    }
+
+    // the slot of a subtree doubles as its lock, only the thread managing to
+    // mark it as busy partitions the range of the subtree
+    // if that throws, the slot is unlocked again and waiting threads retry
+    void evaluate(Cursor const& cursor) const
+    {
+        if (cursor.range.is_leaf())
+            return; // nothing to partition
+
+        std::atomic<Node*>& slot = *cursor.node;
+
+        for (;;) {
+            Node* node = slot.load(std::memory_order_acquire);
+
+            if (node == busy_marker()) {
+                // another thread is evaluating this subtree, wait for it to finish
+                std::this_thread::yield();
+                continue;
+            }
+
+            if (node)
+                return; // already evaluated
+
+            Node* expected = nullptr;
+            if (slot.compare_exchange_strong(expected, busy_marker(), std::memory_order_acquire)) {
+                try {
+                    Search::median_dimension_sort(storage, cursor.range);
+                    slot.store(create_node(), std::memory_order_release);
+                } catch (...) {
+                    slot.store(nullptr, std::memory_order_release);
+                    throw;
+                }
+                return;
+            }
+        }
+    }
+
+    inline Cursor negative(Cursor const& cursor) const
+    {
+        return Cursor{ &cursor.node->load(std::memory_order_acquire)->childNegative, cursor.range.negative() };
+    }
+
+    inline Cursor positive(Cursor const& cursor) const
+    {
+        return Cursor{ &cursor.node->load(std::memory_order_acquire)->childPositive, cursor.range.positive() };
+    }
+
+    inline std::vector<size_t> const* pending(Cursor const&) const
+    {
+        return nullptr;
+    }
+
+    inline bool erased(size_t) const
+    {
+        return false;
+    }
+
+    inline bool next_nearest(typename Search::template Frontier<Cursor>& frontier, size_t& position, double& sqrDistance) const
+    {
+        return Search::next_nearest(*this, frontier, position, sqrDistance);
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+public:
+
+    // evaluates the tree using threadCount threads, may run during queries
+    void ensure_evaluated_fully(size_t threadCount = 1) const
+    {
+        Search::evaluate_fully(*this, root_cursor(), threadCount);
+    }
+
+//------------------------------------------------------------------------------
+
+    P nearest(P const& search) const
+    {
+        return point(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // the index the nearest point had within the input of the tree
+    size_t nearest_index(P const& search) const
+    {
+        return index(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // approximate nearest neighbor, at most (1 + eps) times as far away as the
+    // exact one, backtracking stops after maxVisited subtrees were visited
+    P nearest_approx(P const& search, double eps, size_t maxVisited = std::numeric_limits<size_t>::max()) const
+    {
+        return point(Search::nearest(*this, root_cursor(), search, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+    // all points in increasing distance to search (see NearestIterator)
+    // a single iterator must not be advanced by several threads at once
+    NearestIterator<P, BucketSize, const ConcurrentLazyKdTree> nearest_iterator(P const& search) const
+    {
+        return NearestIterator<P, BucketSize, const ConcurrentLazyKdTree>(*this,
+            typename Search::template Frontier<Cursor>(root_cursor(), search));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> k_nearest(P const& search, size_t n) const
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        return Search::points_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    std::vector<size_t> k_nearest_indices(P const& search, size_t n) const
+    {
+        if (n < 1) return std::vector<size_t>(); // no real search if n < 1
+
+        return Search::indices_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    // see nearest_approx(), might return fewer than n points if maxVisited is reached
+    std::vector<P> k_nearest_approx(P const& search, size_t n, double eps, size_t maxVisited = std::numeric_limits<size_t>::max()) const
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        return Search::points_at(*this,
+            Search::k_nearest(*this, root_cursor(), search, n, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> in_hypersphere(P const& search, double radius) const
+    {
+        if (radius <= 0.0) return std::vector<P>(); // no real search if radius <= 0
+
+        return Search::points_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
+    }
+
+    std::vector<size_t> in_hypersphere_indices(P const& search, double radius) const
+    {
+        if (radius <= 0.0) return std::vector<size_t>(); // no real search if radius <= 0
+
+        return Search::indices_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> in_box(P const& search, P const& sizes) const
+    {
+        if (!Search::is_valid_box(sizes))
+            return std::vector<P>(); // no real search if one dimension size is <= 0
+
+        return Search::points_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+    std::vector<size_t> in_box_indices(P const& search, P const& sizes) const
+    {
+        if (!Search::is_valid_box(sizes))
+            return std::vector<size_t>(); // no real search if one dimension size is <= 0
+
+        return Search::indices_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+//------------------------------------------------------------------------------
+
+    // calls f(point) for every point within the sphere / box, without creating
+    // any container, f may return false to stop the search
+    template <typename F>
+    void for_each_in_hypersphere(P const& search, double radius, F&& f) const
+    {
+        if (radius <= 0.0) return; // no real search if radius <= 0
+
+        Search::for_each_in_hypersphere(*this, root_cursor(), search, radius, f);
+    }
+
+    template <typename F>
+    void for_each_in_box(P const& search, P const& sizes, F&& f) const
+    {
+        if (!Search::is_valid_box(sizes))
+            return; // no real search if one dimension size is <= 0
+
+        Search::for_each_in_box(*this, root_cursor(), search, sizes, f);
+    }
+
+    // write all points within the sphere / box to out
+    template <typename OutputIt>
+    OutputIt in_hypersphere(P const& search, double radius, OutputIt out) const
+    {
+        for_each_in_hypersphere(search, radius, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+    template <typename OutputIt>
+    OutputIt in_box(P const& search, P const& sizes, OutputIt out) const
+    {
+        for_each_in_box(search, sizes, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+//------------------------------------------------------------------------------
+
+    // the batch queries process all searches at once using threadCount threads,
+    // which is faster than querying them one by one
+    // results[i] is the result for searches[i]
+    void nearest_batch(std::vector<P> const& searches, std::vector<P>& results, size_t threadCount = 1) const
+    {
+        Search::nearest_batch(*this, root_cursor(), searches, results, threadCount);
+    }
+
+    void k_nearest_batch(std::vector<P> const& searches, size_t n, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Search::k_nearest_batch(*this, root_cursor(), searches, n, results, threadCount);
+    }
+
+    void in_hypersphere_batch(std::vector<P> const& searches, double radius, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Search::in_hypersphere_batch(*this, root_cursor(), searches, radius, results, threadCount);
+    }
+
+    void in_box_batch(std::vector<P> const& searches, P const& sizes, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Search::in_box_batch(*this, root_cursor(), searches, sizes, results, threadCount);
+    }
+
+//------------------------------------------------------------------------------
+
+    size_t size() const
+    {
+        return storage.size();
+    }
+};
+
+}
+
+#endif // CONCURRENTLAZYKDTREE_H
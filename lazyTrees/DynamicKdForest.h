@@ -0,0 +1,211 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef DYNAMICKDFOREST_H
+#define DYNAMICKDFOREST_H
+
+#include <iterator>
+
+#include "KdTree.h"
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+// a set of lazy k-d trees for workloads with many insertions
+// (the logarithmic method of Bentley and Saxe)
+// the trees are ordered by decreasing size, inserted points form a new tree,
+// which is merged with all trees not larger than itself, so every point is
+// merged O(log n) times, and merging only moves points, since the merged tree
+// is unevaluated until queried
+// the queries search all trees, the nearest neighbor searches sharing the
+// candidates found so far as bound for the following trees
+// requirements of P are the same as for LazyKdTree
+template <typename P, size_t BucketSize = 1>
+class DynamicKdForest {
+private:
+    typedef LazyKdTree<P, BucketSize> Tree;
+    typedef detail::KdSearch<P, BucketSize> Search;
+    typedef typename Search::Candidate Candidate;
+    typedef typename Search::Candidates Candidates;
+
+    std::vector<std::unique_ptr<Tree> > trees;
+
+    size_t nPoints;
+
+//------------------------------------------------------------------------------
+
+public:
+    DynamicKdForest()
+        : trees()
+        , nPoints(0)
+    {}
+
+    explicit DynamicKdForest(std::vector<P>&& in)
+        : trees()
+        , nPoints(0)
+    {
+        insert(std::move(in));
+    }
+
+    explicit DynamicKdForest(std::vector<P> const& in)
+        : trees()
+        , nPoints(0)
+    {
+        insert(in.begin(), in.end());
+    }
+
+    DynamicKdForest(DynamicKdForest&&) = default;
+
+    DynamicKdForest(DynamicKdForest const&) = delete;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    inline void throw_if_empty() const
+    {
+      if (nPoints == 0)
+        throw std::logic_error("DynamicKdForest has no points to search");
+    }
+
+    // moves the points of tree to the end of pts, leaving the tree empty
+    static void take_points(Tree& tree, std::vector<P>& pts)
+    {
+        tree.storage.release(pts);
+    }
+
+    // the candidates of previous trees are offered to the following ones with
+    // positions beyond the ones of any tree
+    static inline size_t seed_position(size_t i)
+    {
+        return std::numeric_limits<size_t>::max() - i;
+    }
+
+    // the n nearest points of all trees in increasing distance, as pairs of
+    // square distance and point
+    std::vector<std::pair<double, P> > k_nearest_pairs(P const& search, size_t n)
+    {
+        std::vector<std::pair<double, P> > best, merged;
+        Candidates candidates;
+
+        for (auto& tree : trees) {
+            for (size_t i = 0; i < best.size(); ++i)
+                candidates.push(Candidate(best[i].first, seed_position(i)));
+
+            Search::offer_k_nearest(*tree, tree->root_cursor(), search, n, candidates);
+
+            // the heap returns the furthest candidate first
+            merged.clear();
+            for (; !candidates.empty(); candidates.pop()) {
+                Candidate const& candidate = candidates.top();
+                if (candidate.second > seed_position(best.size()))
+                    merged.push_back(best[seed_position(0) - candidate.second]);
+                else
+                    merged.push_back(std::make_pair(candidate.first, tree->point(candidate.second)));
+            }
+            std::reverse(merged.begin(), merged.end());
+            best.swap(merged);
+        }
+
+        return best;
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+public:
+    // the points form a new tree, which is merged with all smaller trees
+    void insert(std::vector<P>&& pts)
+    {
+        if (pts.empty())
+            return;
+
+        nPoints += pts.size();
+
+        while (!trees.empty() && trees.back()->size() <= pts.size()) {
+            take_points(*trees.back(), pts);
+            trees.pop_back();
+        }
+
+        trees.push_back(std::unique_ptr<Tree>(new Tree(std::move(pts))));
+    }
+
+    inline void insert(P const& p)
+    {
+        insert(std::vector<P>{ p });
+    }
+
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last)
+    {
+        insert(std::vector<P>(first, last));
+    }
+
+//------------------------------------------------------------------------------
+
+    P nearest(P const& search)
+    {
+        throw_if_empty();
+        return k_nearest_pairs(search, 1).front().second;
+    }
+
+    std::vector<P> k_nearest(P const& search, size_t n)
+    {
+        std::vector<P> res;
+        if (n < 1) return res; // no real search if n < 1
+
+        for (auto& candidate : k_nearest_pairs(search, n))
+            res.push_back(candidate.second);
+        return res;
+    }
+
+    std::vector<P> in_hypersphere(P const& search, double radius)
+    {
+        std::vector<P> res;
+        for (auto& tree : trees)
+            tree->in_hypersphere(search, radius, std::back_inserter(res));
+        return res;
+    }
+
+    std::vector<P> in_box(P const& search, P const& sizes)
+    {
+        std::vector<P> res;
+        for (auto& tree : trees)
+            tree->in_box(search, sizes, std::back_inserter(res));
+        return res;
+    }
+
+//------------------------------------------------------------------------------
+
+    void ensure_evaluated_fully(size_t threadCount = 1)
+    {
+        for (auto& tree : trees)
+            tree->ensure_evaluated_fully(threadCount);
+    }
+
+    // the number of trees, at most one per bit of size() for single insertions
+    size_t tree_count() const
+    {
+        return trees.size();
+    }
+
+    size_t size() const
+    {
+        return nPoints;
+    }
+};
+
+}
+
+#endif // DYNAMICKDFOREST_H
@@ -14,465 +14,2547 @@
 #ifndef KDTREE_H
 #define KDTREE_H
 
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
+#include "NodePool.h"
+#include "PointStorage.h"
+#include "PointTraits.h"
+#include "SimdKernels.h"
+#include "TaskPool.h"
+#include "TraversalStats.h"
+#include "TreeFile.h"
+
 namespace lazyTrees {
 
 //------------------------------------------------------------------------------
 
+namespace detail {
 
-// P must implement static size_t dimensions() returning number of dimensions
-// P also must be const random-accessable for up to [dimensions() - 1] returning
-// the X / Y / Z / ... coordinate of the point
-template <typename P>
-class LazyKdTree {
-private:
-    enum Compare {
-        NEGATIVE,
-        POSITIVE
-    };
-
-    std::unique_ptr<std::vector<P> > inputData;
+enum Compare {
+    NEGATIVE,
+    POSITIVE
+};
 
-    std::unique_ptr<LazyKdTree> childNegative, childPositive;
+//------------------------------------------------------------------------------
 
-    std::unique_ptr<P> data;
+// all points of a tree are kept within one buffer, a subtree always covers a
+// range [begin, end) of it with its own point at the median of the range
+// evaluating a subtree partitions its range around that median in place
+// the children of a subtree are the ranges left and right of its median
+// ranges of up to BucketSize points aren't split any further, but form a leaf
+// bucket which is scanned linearly
+template <typename P, size_t BucketSize>
+struct Range {
+    size_t begin, end, dim;
 
-    const size_t dim;
+    inline size_t size() const
+    {
+        return end - begin;
+    }
 
-//------------------------------------------------------------------------------
+    inline size_t median() const
+    {
+        return begin + size() / 2;
+    }
 
-public:
-    LazyKdTree(std::vector<P>&& in, int dimension = 0)
-        : inputData(new std::vector<P>(std::move(in)))
-        , childNegative(nullptr)
-        , childPositive(nullptr)
-        , data(nullptr)
-        , dim(dimension % P::dimensions())
+    inline bool is_leaf() const
     {
-      throw_if_input_empty();
+        return size() <= BucketSize;
     }
 
-    LazyKdTree(std::vector<P> const& in, int dimension = 0)
-        : inputData(new std::vector<P>(in))
-        , childNegative(nullptr)
-        , childPositive(nullptr)
-        , data(nullptr)
-        , dim(dimension % P::dimensions())
+    inline bool is_empty() const
     {
-      throw_if_input_empty();
+        return size() == 0;
     }
 
-    LazyKdTree(LazyKdTree&&) = default;
+    inline Range negative() const
+    {
+        return Range{ begin, median(), (dim + 1) % PointTraits<P>::dimensions() };
+    }
 
-    ///@todo maybe write impl in the future (also implement for strict version then)
-    LazyKdTree(LazyKdTree const&) = delete;
+    inline Range positive() const
+    {
+        return Range{ median() + 1, end, (dim + 1) % PointTraits<P>::dimensions() };
+    }
+};
 
 //------------------------------------------------------------------------------
-//------------------------------------------------------------------------------
 
-private:
-    inline void throw_if_input_empty() const
+// bounds the work of the nearest neighbor searches
+// the "wrong" side of a split is only searched if it might contain points
+// closer than factor times the currently best distance, and only as long as
+// the budget of subtrees to visit isn't used up
+struct Limits {
+    double factor;
+    size_t budget;
+
+    static inline Limits exact()
     {
-      if (!inputData || inputData->size() == 0)
-        throw std::logic_error("LazyKdTree can't be constructed from empty inputs");
+        return Limits{ 1.0, std::numeric_limits<size_t>::max() };
     }
 
-    inline bool is_leaf() const
+    // the results are at most (1 + eps) times as far away as the exact ones
+    static inline Limits approximate(double eps, size_t maxVisited)
     {
-        return !childNegative && !childPositive;
+        return Limits{ 1.0 / (1.0 + std::max(eps, 0.0)), maxVisited };
     }
 
-    inline bool is_evaluated() const
+    // called for every visited subtree
+    inline void visit()
     {
-        return inputData == nullptr;
+        if (budget > 0)
+            --budget;
     }
 
-    void ensure_evaluated()
+    inline bool may_backtrack() const
     {
-        if (is_evaluated())
-            return;
-
-        if (inputData->size() == 1) {
-            data = std::unique_ptr<P>(new P(std::move((*inputData.get())[0])));
-            inputData.reset();
-        }
+        return budget > 0;
+    }
+};
 
-        else if (inputData->size() > 1) {
-            const size_t median = inputData->size() / 2;
-            std::vector<P> inputNegative, inputPositive;
+//------------------------------------------------------------------------------
 
-            inputNegative.reserve(median - 1);
-            inputPositive.reserve(median - 1);
+// the explicit stack replacing recursion within the traversals
+// the children of a range hold at most half of its points, so a tree has at
+// most one level per bit of size_t, and the traversals keep at most one
+// pending entry per level, therefore the stack never has to grow
+template <typename T>
+class TraversalStack {
+private:
+    static constexpr size_t Capacity = std::numeric_limits<size_t>::digits + 1;
 
-            median_dimension_sort(*inputData.get(), dim);
+    T entries[Capacity];
+    size_t n;
 
-            for (size_t i = 0; i < inputData->size(); ++i) {
-                if (i < median)
-                    inputNegative.push_back(std::move((*(inputData.get()))[i]));
-                else if (i > median)
-                    inputPositive.push_back(std::move((*(inputData.get()))[i]));
-            }
+public:
+    TraversalStack()
+        : n(0)
+    {}
 
-            data = std::unique_ptr<P>(new P(std::move((*inputData.get())[median])));
+    inline bool empty() const
+    {
+        return n == 0;
+    }
 
-            inputData.reset();
+    inline void push(T const& entry)
+    {
+        entries[n++] = entry;
+    }
 
-            if (inputNegative.size() > 0)
-                childNegative = std::unique_ptr<LazyKdTree>(
-                    new LazyKdTree(std::move(inputNegative), dim + 1));
-            if (inputPositive.size() > 0)
-                childPositive = std::unique_ptr<LazyKdTree>(
-                    new LazyKdTree(std::move(inputPositive), dim + 1));
-        }
+    inline T pop()
+    {
+        return entries[--n];
     }
+};
 
 //------------------------------------------------------------------------------
-//------------------------------------------------------------------------------
+
+// the queries shared by all tree types, they return positions within the buffer
+// Tree must offer a Cursor type with a .range member and
+//   P const& point(size_t position)         the point at position of the buffer
+//   Scalar coordinate(size_t position, size_t dim)
+//                                           coordinate dim of the point at position
+//   Scalar const* coordinates(size_t dim)   all coordinates of dim if stored contiguously, nullptr otherwise
+//   size_t index(size_t position)           the index the point at position had within the input
+//   void evaluate(Cursor const&)            ensures the range of the cursor is partitioned
+//   Cursor negative(Cursor const&)          the cursors of the children
+//   Cursor positive(Cursor const&)          (only called on evaluated non-leaf cursors)
+//   std::vector<size_t> const* pending(Cursor const&)
+//                                           positions of points inserted into the subtree, which
+//                                           aren't placed within its range, nullptr if there are none
+//   bool erased(size_t position)            whether the point at position was erased, such points are skipped
+//   stats()                                 the observer of the current query (see TraversalStats.h)
+template <typename P, size_t BucketSize>
+class KdSearch {
+private:
+    typedef detail::Range<P, BucketSize> Range;
+    typedef PointTraits<P> Traits;
+    typedef typename Traits::Scalar Scalar;
+    typedef typename Traits::Distance Distance;
 
 public:
+    typedef std::pair<double, size_t> Candidate; // square distance and position
+    typedef std::priority_queue<Candidate> Candidates;
 
-    void ensure_evaluated_fully()
+    template <typename Tree>
+    static size_t nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, Limits limits = Limits::exact())
     {
-        ensure_evaluated();
-        if (childNegative)
-            childNegative->ensure_evaluated_fully();
-        if (childPositive)
-            childPositive->ensure_evaluated_fully();
+        return find_nearest(tree, cursor, search, limits);
     }
 
 //------------------------------------------------------------------------------
 
-    P nearest(P const& search)
+    // all candidates are collected within a single bounded max-heap, its top
+    // being the currently worst candidate which defines the pruning distance
+    // with a budget, fewer than n points might be found
+    template <typename Tree>
+    static std::vector<size_t> k_nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, size_t n,
+        Limits limits = Limits::exact())
+    {
+        std::vector<Candidate> container;
+        container.reserve(std::min(n, cursor.range.size()));
+        Candidates candidates(std::less<Candidate>(), std::move(container));
+
+        std::vector<size_t> res;
+        k_nearest(tree, cursor, search, n, candidates, res, limits);
+        return res;
+    }
+
+    // candidates must be empty and is empty again afterwards, but keeps its
+    // capacity, so it can be reused for further queries
+    template <typename Tree>
+    static void k_nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, size_t n, Candidates& candidates,
+        std::vector<size_t>& res, Limits limits = Limits::exact())
     {
-        ensure_evaluated();
+        collect_k_nearest(tree, cursor, search, n, candidates, limits);
+
+        res.clear();
+        res.reserve(candidates.size());
+        for (; !candidates.empty(); candidates.pop())
+            res.push_back(candidates.top().second);
+
+        // the heap returns the furthest candidate first
+        std::reverse(res.begin(), res.end());
+    }
 
-        if (is_leaf())
-            return *data.get(); // reached the end, return current value
+    // offers the points of the subtree to candidates, keeping the n nearest
+    // candidates may already hold candidates from elsewhere (e.g. other trees),
+    // which bound the search just like the ones found within the subtree
+    template <typename Tree>
+    static void offer_k_nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, size_t n, Candidates& candidates)
+    {
+        Limits limits = Limits::exact();
+        collect_k_nearest(tree, cursor, search, n, candidates, limits);
+    }
 
-        const auto comp = dimension_compare(search, *data.get(), dim);
+//------------------------------------------------------------------------------
 
-        P best; // nearest neighbor of search
+    // the state of an incremental nearest neighbor search (see NearestIterator)
+    // a best-first frontier of points and subtrees, ordered by their square
+    // distance to search, for subtrees a lower bound of the one of their points
+    // subtrees are only evaluated once they reach the top of the frontier
+    template <typename Cursor>
+    class Frontier {
+    private:
+        friend class KdSearch;
+
+        struct Entry {
+            double sqrDistance;
+            size_t position; // of the point, unused for subtrees
+            bool isPoint;
+            Cursor cursor;   // of the subtree, unused for points
+        };
+
+        // on ties points come first, they can be returned right away
+        struct Later {
+            inline bool operator()(Entry const& a, Entry const& b) const
+            {
+                if (a.sqrDistance != b.sqrDistance)
+                    return a.sqrDistance > b.sqrDistance;
+                return !a.isPoint && b.isPoint;
+            }
+        };
 
-        if (comp == NEGATIVE && childNegative)
-            best = childNegative->nearest(search);
-        else if (comp == POSITIVE && childPositive)
-            best = childPositive->nearest(search);
-        else
-            return *data.get();
+        P search;
+        std::priority_queue<Entry, std::vector<Entry>, Later> entries;
 
-        double sqrDistanceBest = square_dist(search, best);
-        const double sqrDistanceThis = square_dist(search, *data.get());
+        inline void push_point(size_t position, double sqrDistance)
+        {
+            entries.push(Entry{ sqrDistance, position, true, Cursor() });
+        }
 
-        if (sqrDistanceThis < sqrDistanceBest) {
-            sqrDistanceBest = sqrDistanceThis;
-            best = *data.get(); // make this value the best if it is closer than the
-            // checked side
-            // type
+        inline void push_subtree(Cursor const& cursor, double sqrDistance)
+        {
+            entries.push(Entry{ sqrDistance, 0, false, cursor });
         }
 
-        // check whether other side might have candidates as well
-        const double distanceBest   = std::sqrt(sqrDistanceBest);
-        const double borderNegative = search[dim] - distanceBest;
-        const double borderPositive = search[dim] + distanceBest;
+    public:
+        Frontier(Cursor const& root, P const& search)
+            : search(search)
+            , entries()
+        {
+            push_subtree(root, 0.0);
+        }
+    };
 
-        // check whether distances to other side are smaller than currently best
-        // and recurse into the "wrong" direction, to check for possibly additional
-        // candidates
-        if (comp == NEGATIVE && childPositive) {
-            if (borderPositive >= (*data.get())[dim]) {
-                const auto otherBest = childPositive->nearest(search);
-                if (square_dist(search, otherBest) < square_dist(search, best))
-                    best = otherBest;
-            }
-        } else if (comp == POSITIVE && childNegative) {
-            if (borderNegative <= (*data.get())[dim]) {
-                const auto otherBest = childNegative->nearest(search);
-                if (square_dist(search, otherBest) < square_dist(search, best))
-                    best = otherBest;
+    // expands the frontier until a point is on top of it and pops that point
+    // returns false once all points were returned
+    template <typename Tree>
+    static bool next_nearest(Tree& tree, Frontier<typename Tree::Cursor>& frontier, size_t& position, double& sqrDistance)
+    {
+        while (!frontier.entries.empty()) {
+            const auto entry = frontier.entries.top();
+            frontier.entries.pop();
+
+            if (entry.isPoint) {
+                position = entry.position;
+                sqrDistance = entry.sqrDistance;
+                return true;
             }
+
+            expand(tree, frontier, entry.cursor, entry.sqrDistance);
         }
+        return false;
+    }
 
-        return best;
+//------------------------------------------------------------------------------
+
+    // positions of all points within the sphere / box
+    template <typename Tree>
+    static std::vector<size_t> in_hypersphere(Tree& tree, typename Tree::Cursor const& cursor, P const& search, double radius)
+    {
+        std::vector<size_t> res;
+        auto collect = [&res](size_t position) { res.push_back(position); return true; };
+        visit_in_hypersphere(tree, cursor, search, radius, collect);
+        return res;
+    }
+
+    template <typename Tree>
+    static std::vector<size_t> in_box(Tree& tree, typename Tree::Cursor const& cursor, P const& search, P const& sizes)
+    {
+        std::vector<size_t> res;
+        auto collect = [&res](size_t position) { res.push_back(position); return true; };
+        visit_in_box(tree, cursor, search, sizes, collect);
+        return res;
+    }
+
+    // call f(point) for all points within the sphere / box
+    // f may return false to stop the search, any other return type is ignored
+    template <typename Tree, typename F>
+    static void for_each_in_hypersphere(Tree& tree, typename Tree::Cursor const& cursor, P const& search, double radius, F& f)
+    {
+        auto visit = [&tree, &f](size_t position) { return call_visitor(f, tree.point(position)); };
+        visit_in_hypersphere(tree, cursor, search, radius, visit);
+    }
+
+    template <typename Tree, typename F>
+    static void for_each_in_box(Tree& tree, typename Tree::Cursor const& cursor, P const& search, P const& sizes, F& f)
+    {
+        auto visit = [&tree, &f](size_t position) { return call_visitor(f, tree.point(position)); };
+        visit_in_box(tree, cursor, search, sizes, visit);
     }
 
 //------------------------------------------------------------------------------
 
-    std::vector<P> k_nearest(P const& search, size_t n)
+    // the batch versions process the searches in spatial order, so consecutive
+    // searches mostly visit the same parts of the tree
+    // with nThreads > 1, chunks of that order are processed in parallel, which
+    // requires the queries of tree to be thread-safe
+    // results[i] is the result for searches[i]
+
+    template <typename Tree>
+    static void nearest_batch(Tree& tree, typename Tree::Cursor const& cursor, std::vector<P> const& searches,
+        std::vector<P>& results, size_t nThreads)
     {
-        ensure_evaluated();
+        results.resize(searches.size());
+        for_each_search(searches, nThreads, [&](size_t i, size_t) {
+            results[i] = tree.point(nearest(tree, cursor, searches[i]));
+        });
+    }
 
-        if (n < 1)     return std::vector<P>(); // no real search if n < 1
-        if (is_leaf()) return std::vector<P>{ *(data.get()) }; // no further recursion, return current value
+    template <typename Tree>
+    static void k_nearest_batch(Tree& tree, typename Tree::Cursor const& cursor, std::vector<P> const& searches,
+        size_t n, std::vector<std::vector<P> >& results, size_t nThreads)
+    {
+        results.resize(searches.size());
 
-        auto res = std::vector<P>();
+        if (n < 1) // no real search if n < 1
+            return clear_all(results);
 
-        // decide which side to check and recurse into it
-        const auto comp = dimension_compare(search, *(data.get()), dim);
+        // scratch buffers, one per worker
+        std::vector<Candidates> candidates(std::max<size_t>(nThreads, 1));
+        std::vector<std::vector<size_t> > positions(candidates.size());
 
-        if (comp == NEGATIVE) {
-            if (childNegative) {
-                move_append(childNegative->k_nearest(search, n), res);
-                sort_and_limit(res, search, n);
-            }
-        } else if (childPositive) {
-            move_append(childPositive->k_nearest(search, n), res);
-            sort_and_limit(res, search, n);
-        }
-
-        // check whether other side might have candidates as well
-        const double distanceBest   = res.size() > 0
-                                    ? std::sqrt(square_dist(search, res.back()))
-                                    : 0;
-        const double borderNegative = search[dim] - distanceBest;
-        const double borderPositive = search[dim] + distanceBest;
-
-        // check whether distances to other side are smaller than currently worst
-        // candidate
-        // and recurse into the "wrong" direction, to check for possibly additional
-        // candidates
-        if (comp == NEGATIVE && childPositive) {
-            if (res.size() < n || borderPositive >= (*data.get())[dim]) {
-                move_append(childPositive->k_nearest(search, n), res);
-                sort_and_limit(res, search, n);
-            }
-        } else if (comp == POSITIVE && childNegative) {
-            if (res.size() < n || borderNegative <= (*data.get())[dim]) {
-                move_append(childNegative->k_nearest(search, n), res);
-                sort_and_limit(res, search, n);
-            }
-        }
+        for_each_search(searches, nThreads, [&](size_t i, size_t worker) {
+            k_nearest(tree, cursor, searches[i], n, candidates[worker], positions[worker]);
+            points_at(tree, positions[worker], results[i]);
+        });
+    }
 
-        if (res.size() < n || square_dist(search, *(data.get())) < square_dist(search, res.back())) {
-            res.push_back(*(data.get())); // add current node if there is still room
-            sort_and_limit(res, search, n);
-        }
+    template <typename Tree>
+    static void in_hypersphere_batch(Tree& tree, typename Tree::Cursor const& cursor, std::vector<P> const& searches,
+        double radius, std::vector<std::vector<P> >& results, size_t nThreads)
+    {
+        results.resize(searches.size());
 
-        return res;
+        if (radius <= 0.0) // no real search if radius <= 0
+            return clear_all(results);
+
+        for_each_search(searches, nThreads, [&](size_t i, size_t) {
+            points_at(tree, in_hypersphere(tree, cursor, searches[i], radius), results[i]);
+        });
+    }
+
+    template <typename Tree>
+    static void in_box_batch(Tree& tree, typename Tree::Cursor const& cursor, std::vector<P> const& searches,
+        P const& sizes, std::vector<std::vector<P> >& results, size_t nThreads)
+    {
+        results.resize(searches.size());
+
+        if (!is_valid_box(sizes)) // no real search if one dimension size is <= 0
+            return clear_all(results);
+
+        for_each_search(searches, nThreads, [&](size_t i, size_t) {
+            points_at(tree, in_box(tree, cursor, searches[i], sizes), results[i]);
+        });
     }
 
 //------------------------------------------------------------------------------
 
-    std::vector<P> in_hypersphere(P const& search, double radius)
+    template <typename Tree>
+    static void points_at(Tree& tree, std::vector<size_t> const& positions, std::vector<P>& res)
     {
-        ensure_evaluated();
+        res.clear();
+        res.reserve(positions.size());
+        for (const auto position : positions)
+            res.push_back(tree.point(position));
+    }
 
-        if (radius <= 0.0) return std::vector<P>(); // no real search if radius <= 0
+    template <typename Tree>
+    static std::vector<P> points_at(Tree& tree, std::vector<size_t> const& positions)
+    {
+        std::vector<P> res;
+        points_at(tree, positions, res);
+        return res;
+    }
 
-        std::vector<P> res; // all points within the sphere
-        if (sqrt(square_dist(search, *(data.get()))) <= radius)
-            res.push_back(*(data.get())); // add current node if it is within the search radius
+    template <typename Tree>
+    static std::vector<size_t> indices_at(Tree& tree, std::vector<size_t> positions)
+    {
+        for (auto& position : positions)
+            position = tree.index(position);
+        return positions;
+    }
 
-        if (is_leaf()) return res; // no children, return result
+//------------------------------------------------------------------------------
 
-        // decide which side to check and recurse into it
-        const auto comp = dimension_compare(search, *(data.get()), dim);
-        if (comp == NEGATIVE) {
-            if (childNegative)
-                move_append(childNegative->in_hypersphere(search, radius), res);
-        } else if (childPositive) {
-            move_append(childPositive->in_hypersphere(search, radius), res);
+    static inline bool is_valid_box(P const& sizes)
+    {
+        for (size_t i = 0; i < Traits::dimensions(); ++i) {
+            if (sizes[i] <= 0.0)
+                return false;
         }
+        return true;
+    }
+
+    // partitions the range around its median, returning the number of points moved
+    template <typename Storage>
+    static inline size_t median_dimension_sort(Storage& storage, Range const& range)
+    {
+        return storage.partition(range.begin, range.median(), range.end, range.dim);
+    }
 
-        const double borderNegative = search[dim] - radius;
-        const double borderPositive = search[dim] + radius;
+    // evaluates the subtrees in the same order as a recursive descent would,
+    // negative sides first
+    template <typename Tree>
+    static void evaluate_fully(Tree& tree, typename Tree::Cursor const& cursor)
+    {
+        TraversalStack<typename Tree::Cursor> stack;
+        stack.push(cursor);
+
+        while (!stack.empty()) {
+            const auto current = stack.pop();
+            if (current.range.is_leaf())
+                continue;
 
-        // check whether distances to other side are smaller than radius
-        // and recurse into the "wrong" direction, to check for possibly aditional
-        // candidates
-        if (comp == NEGATIVE && childPositive) {
-            if (borderPositive >= (*data.get())[dim])
-                move_append(childPositive->in_hypersphere(search, radius), res);
-        } else if (comp == POSITIVE && childNegative) {
-            if (borderNegative <= (*data.get())[dim])
-                move_append(childNegative->in_hypersphere(search, radius), res);
+            tree.evaluate(current);
+            stack.push(tree.positive(current));
+            stack.push(tree.negative(current));
         }
+    }
 
-        return res;
+    // the subtrees are evaluated as tasks of a work-stealing pool, down to
+    // subtrees of parallel_min_size() points which are evaluated sequentially
+    // tree.evaluate() must be safe to call for distinct subtrees concurrently
+    template <typename Tree>
+    static void evaluate_fully(Tree& tree, typename Tree::Cursor const& cursor, size_t nThreads)
+    {
+        if (nThreads <= 1 || cursor.range.size() <= parallel_min_size()) {
+            evaluate_fully(tree, cursor);
+            return;
+        }
+
+        TaskPool::run(nThreads, [&tree, cursor](TaskPool& pool, size_t worker) {
+            evaluate_task(tree, cursor, pool, worker);
+        });
     }
 
+    // partitions the whole range, without keeping track of nodes
+    template <typename Storage>
+    static void evaluate_fully(Storage& storage, Range const& range, size_t nThreads = 1)
+    {
+        Partitioner<Storage> partitioner{ storage };
+        evaluate_fully(partitioner, typename Partitioner<Storage>::Cursor{ range }, nThreads);
+    }
+
+//------------------------------------------------------------------------------
 //------------------------------------------------------------------------------
 
-    std::vector<P> in_box(P const& search, P const& sizes)
-    {
-        ensure_evaluated();
+private:
+    // cursor interface to a plain buffer, used to build trees without nodes
+    template <typename Storage>
+    struct Partitioner {
+        struct Cursor {
+            Range range;
+        };
+
+        Storage& storage;
+
+        inline void evaluate(Cursor const& cursor)
+        {
+            median_dimension_sort(storage, cursor.range);
+        }
 
-        for (size_t i = 0; i < P::dimensions(); ++i) {
-            if (sizes[i] <= 0.0)
-                return std::vector<P>(); // no real search if one dimension size is <= 0
+        inline Cursor negative(Cursor const& cursor) const
+        {
+            return Cursor{ cursor.range.negative() };
+        }
+
+        inline Cursor positive(Cursor const& cursor) const
+        {
+            return Cursor{ cursor.range.positive() };
         }
+    };
 
-        std::vector<P> res; // all points within the box
+    static inline size_t parallel_min_size()
+    {
+        return 1 << 14;
+    }
 
-        bool inBox = true;
-        for (size_t i = 0; i < P::dimensions() && inBox; ++i)
-            inBox = dimension_dist(search, *(data.get()), i) <= 0.5 * sizes[i];
+    static inline size_t batch_chunk_size()
+    {
+        return 256;
+    }
 
-        if (inBox) res.push_back(*(data.get()));
+    static inline void clear_all(std::vector<std::vector<P> >& results)
+    {
+        for (auto& res : results)
+            res.clear();
+    }
 
-        if (is_leaf()) return res; // no children, return result
+    // calls f(index, worker) for every search, in spatial order
+    template <typename F>
+    static void for_each_search(std::vector<P> const& searches, size_t nThreads, F const& f)
+    {
+        const auto order = spatial_order(searches);
 
-        // decide which side to check and recurse into it
-        const auto comp = dimension_compare(search, *(data.get()), dim);
-        if (comp == NEGATIVE) {
-            if (childNegative)
-                move_append(childNegative->in_box(search, sizes), res);
-        } else if (childPositive) {
-            move_append(childPositive->in_box(search, sizes), res);
+        if (nThreads <= 1 || order.size() <= batch_chunk_size()) {
+            for (const auto i : order)
+                f(i, 0);
+            return;
         }
 
-        const double borderNegative = search[dim] - 0.5 * sizes[dim];
-        const double borderPositive = search[dim] + 0.5 * sizes[dim];
+        TaskPool::run(nThreads, [&](TaskPool& pool, size_t worker) {
+            for (size_t begin = 0; begin < order.size(); begin += batch_chunk_size()) {
+                pool.spawn(worker, [&, begin](TaskPool&, size_t worker) {
+                    const size_t end = std::min(begin + batch_chunk_size(), order.size());
+                    for (size_t j = begin; j < end; ++j)
+                        f(order[j], worker);
+                });
+            }
+        });
+    }
 
-        // check whether distances to other side are smaller than radius
-        // and recurse into the "wrong" direction, to check for possibly additional
-        // candidates
-        if (comp == NEGATIVE && childPositive) {
-            if (borderPositive >= (*data.get())[dim])
-                move_append(childPositive->in_box(search, sizes), res);
-        } else if (comp == POSITIVE && childNegative) {
-            if (borderNegative <= (*data.get())[dim])
-                move_append(childNegative->in_box(search, sizes), res);
+    // the indices of pts, sorted by the Morton code (Z-order) of the points
+    static std::vector<size_t> spatial_order(std::vector<P> const& pts)
+    {
+        std::vector<size_t> order(pts.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = i;
+
+        // per dimension at most the 53 bits of a double's mantissa, so the
+        // largest cell is exact and fits uint64_t even for a single dimension
+        const size_t nDims = std::min<size_t>(Traits::dimensions(), 64);
+        const size_t nBits = std::min<size_t>(64 / nDims, 53);
+
+        if (pts.size() < 2)
+            return order;
+
+        std::vector<double> min(nDims), max(nDims);
+        for (size_t d = 0; d < nDims; ++d)
+            min[d] = max[d] = pts[0][d];
+
+        for (auto const& p : pts) {
+            for (size_t d = 0; d < nDims; ++d) {
+                min[d] = std::min(min[d], p[d]);
+                max[d] = std::max(max[d], p[d]);
+            }
         }
 
-        return res;
-    }
+        const double maxCell = std::ldexp(1.0, nBits) - 1.0;
+        std::vector<uint64_t> codes(pts.size(), 0);
+        std::vector<uint64_t> cells(nDims);
 
-//------------------------------------------------------------------------------
+        for (size_t i = 0; i < pts.size(); ++i) {
+            for (size_t d = 0; d < nDims; ++d) {
+                const double extent = max[d] - min[d];
+                cells[d] = extent > 0.0
+                         ? static_cast<uint64_t>((pts[i][d] - min[d]) / extent * maxCell)
+                         : 0;
+            }
 
-    size_t size() const
+            // interleave the bits of all dimensions, most significant first
+            for (size_t bit = nBits; bit > 0; --bit) {
+                for (size_t d = 0; d < nDims; ++d)
+                    codes[i] = (codes[i] << 1) | ((cells[d] >> (bit - 1)) & 1);
+            }
+        }
+
+        std::sort(order.begin(), order.end(), [&codes](size_t a, size_t b) {
+            return codes[a] < codes[b];
+        });
+
+        return order;
+    }
+
+    // spawns the negative sides as tasks and continues with the positive ones
+    template <typename Tree>
+    static void evaluate_task(Tree& tree, typename Tree::Cursor cursor, TaskPool& pool, size_t worker)
     {
-        if (!is_evaluated())
-            return inputData->size();
+        while (!cursor.range.is_leaf() && cursor.range.size() > parallel_min_size()) {
+            tree.evaluate(cursor);
 
-        size_t result = 1;
-        if (childNegative)
-            result += childNegative->size();
-        if (childPositive)
-            result += childPositive->size();
-        return result;
+            const auto negative = tree.negative(cursor);
+            pool.spawn(worker, [&tree, negative](TaskPool& pool, size_t worker) {
+                evaluate_task(tree, negative, pool, worker);
+            });
+
+            cursor = tree.positive(cursor);
+        }
+
+        evaluate_fully(tree, cursor);
     }
 
-private:
+    // a side of a split which the descent didn't take, to be searched later if
+    // it might still contain candidates, sqrDistance being the square distance
+    // of search to the splitting plane
+    template <typename Cursor>
+    struct Deferred {
+        Cursor cursor;
+        double sqrDistance;
+    };
 
-//------------------------------------------------------------------------------
-//------------------------------------------------------------------------------
+    template <typename Tree>
+    static inline double square_border_dist(Tree& tree, P const& search, Range const& range)
+    {
+        const Distance distanceBorder = dimension_dist(tree, search, range.median(), range.dim);
+        return distanceBorder * distanceBorder;
+    }
 
-    static inline double square_dist(P const& p1, P const& p2)
+    // descends from cursor towards search down to a leaf, offering all points
+    // on the way and deferring the sides not taken
+    // offer(position, sqrDistance) returns nothing
+    template <typename Tree, typename Offer>
+    static void descend(Tree& tree, typename Tree::Cursor cursor, P const& search, Limits& limits,
+        TraversalStack<Deferred<typename Tree::Cursor> >& stack, Offer const& offer)
     {
-        double sqrDist(0);
-        const auto nDims = P::dimensions();
+        while (true) {
+            tree.evaluate(cursor);
+            tree.stats().node_visited();
+            limits.visit();
+
+            for_each_pending(tree, cursor, [&tree, &search, &offer](size_t i) {
+                offer(i, square_dist(tree, search, i));
+                return true;
+            });
+
+            auto const& range = cursor.range;
+
+            if (range.is_leaf()) { // reached the end, offer all values of bucket
+                scan_bucket(tree, range, search, [&offer](size_t i, double sqrDistance) {
+                    offer(i, sqrDistance);
+                    return true;
+                });
+                return;
+            }
 
-        for (size_t i = 0; i < nDims; ++i)
-            sqrDist += pow(p1[i] - p2[i], 2);
+            const size_t median = range.median();
+            const Scalar split = tree.coordinate(median, range.dim);
 
-        return sqrDist;
+            if (!tree.erased(median))
+                offer(median, square_dist(tree, search, median));
+
+            // the negative side always exists, the positive one might be empty
+            const double sqrDistanceBorder = square_border_dist(tree, search, range);
+
+            if (range.positive().is_empty()) {
+                cursor = tree.negative(cursor);
+            } else if (dimension_compare(search, split, range.dim) == NEGATIVE) {
+                stack.push(Deferred<typename Tree::Cursor>{ tree.positive(cursor), sqrDistanceBorder });
+                cursor = tree.negative(cursor);
+            } else {
+                stack.push(Deferred<typename Tree::Cursor>{ tree.negative(cursor), sqrDistanceBorder });
+                cursor = tree.positive(cursor);
+            }
+        }
     }
 
-    static inline double dimension_dist(P const& p1, P const& p2, size_t dim)
+    // the primary path down to a leaf is always searched, so there is a result
+    // even if the budget of limits is used up
+    // the deferred sides are searched in reverse order, as long as the
+    // distances to them are smaller than factor times the currently best one
+    template <typename Tree>
+    static size_t find_nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, Limits& limits)
     {
-        return std::fabs(p1[dim] - p2[dim]);
+        size_t best = cursor.range.begin; // nearest neighbor of search
+        double sqrDistanceBest = std::numeric_limits<double>::infinity();
+
+        auto offer = [&best, &sqrDistanceBest](size_t i, double sqrDistance) {
+            if (sqrDistance < sqrDistanceBest) {
+                best = i;
+                sqrDistanceBest = sqrDistance;
+            }
+        };
+
+        const double sqrFactor = limits.factor * limits.factor;
+        TraversalStack<Deferred<typename Tree::Cursor> > stack;
+
+        descend(tree, cursor, search, limits, stack, offer);
+
+        while (!stack.empty()) {
+            const auto other = stack.pop();
+            // keeps searching as long as all points so far were erased
+            const bool found = sqrDistanceBest < std::numeric_limits<double>::infinity();
+            if ((limits.may_backtrack() || !found) && other.sqrDistance <= sqrDistanceBest * sqrFactor)
+                descend(tree, other.cursor, search, limits, stack, offer);
+            else
+                tree.stats().node_pruned();
+        }
+
+        return best;
     }
 
-    static inline void median_dimension_sort(std::vector<P>& pts, size_t dim)
+    template <typename Tree>
+    static void collect_k_nearest(Tree& tree, typename Tree::Cursor const& cursor, P const& search, size_t n, Candidates& candidates,
+        Limits& limits)
     {
-        std::nth_element(pts.begin(), pts.begin() + pts.size() / 2, pts.end(),
-            [dim](P const& lhs, P const& rhs) { return lhs[dim] < rhs[dim]; });
+        auto offerCandidate = [&candidates, n](size_t i, double sqrDistance) {
+            offer(candidates, n, sqrDistance, i);
+        };
+
+        const double sqrFactor = limits.factor * limits.factor;
+        TraversalStack<Deferred<typename Tree::Cursor> > stack;
+
+        descend(tree, cursor, search, limits, stack, offerCandidate);
+
+        // the distance to the other side has to be smaller than the one of the
+        // currently worst candidate
+        while (!stack.empty()) {
+            const auto other = stack.pop();
+            const bool mightHaveCandidates = limits.may_backtrack()
+                                          && (candidates.size() < n || other.sqrDistance <= candidates.top().first * sqrFactor);
+            if (mightHaveCandidates)
+                descend(tree, other.cursor, search, limits, stack, offerCandidate);
+            else
+                tree.stats().node_pruned();
+        }
     }
 
-    static inline Compare dimension_compare(P const& lhs, P const& rhs,
-        size_t dim)
+    // replaces a subtree of the frontier by its point(s) and children
+    // the side of search inherits the bound of the subtree, while the other
+    // side is at least as far away as the splitting plane
+    template <typename Tree>
+    static void expand(Tree& tree, Frontier<typename Tree::Cursor>& frontier, typename Tree::Cursor const& cursor, double sqrDistanceBound)
     {
-        if (lhs[dim] <= rhs[dim])
-            return NEGATIVE;
+        tree.evaluate(cursor);
+        tree.stats().node_visited();
+
+        auto const& range = cursor.range;
+        P const& search = frontier.search;
+
+        for_each_pending(tree, cursor, [&tree, &frontier, &search](size_t i) {
+            frontier.push_point(i, square_dist(tree, search, i));
+            return true;
+        });
+
+        if (range.is_leaf()) {
+            scan_bucket(tree, range, search, [&frontier](size_t i, double sqrDistance) {
+                frontier.push_point(i, sqrDistance);
+                return true;
+            });
+            return;
+        }
 
-        return POSITIVE;
+        const size_t median = range.median();
+        const Scalar split = tree.coordinate(median, range.dim);
+
+        if (!tree.erased(median))
+            frontier.push_point(median, square_dist(tree, search, median));
+
+        const double sqrDistanceOther = std::max(sqrDistanceBound, square_border_dist(tree, search, range));
+        const auto comp = dimension_compare(search, split, range.dim);
+
+        frontier.push_subtree(tree.negative(cursor), comp == NEGATIVE ? sqrDistanceBound : sqrDistanceOther);
+        if (!range.positive().is_empty())
+            frontier.push_subtree(tree.positive(cursor), comp == POSITIVE ? sqrDistanceBound : sqrDistanceOther);
     }
 
-    static inline void sort_and_limit(std::vector<P>& target, P const& search,
-        size_t maxSize)
+    static inline void offer(Candidates& candidates, size_t n, double sqrDistance, size_t index)
     {
-        if (target.size() > maxSize) {
-            std::partial_sort(target.begin(), target.begin() + maxSize, target.end(),
-                [&search](P const& a, P const& b) {
-                    return square_dist(search, a) < square_dist(search, b);
+        if (candidates.size() < n) {
+            candidates.push(Candidate(sqrDistance, index));
+        } else if (sqrDistance < candidates.top().first) {
+            candidates.pop();
+            candidates.push(Candidate(sqrDistance, index));
+        }
+    }
+
+    // visit(position) is called for every point found, the traversal stops as
+    // soon as it returns false, in which case false is returned as well
+    // the points are visited in the same order as by a recursive descent,
+    // the side of search before the other one
+    template <typename Tree, typename Visit>
+    static bool visit_in_hypersphere(Tree& tree, typename Tree::Cursor const& cursor, P const& search, double radius, Visit& visit)
+    {
+        const double sqrRadius = radius * radius;
+
+        TraversalStack<typename Tree::Cursor> stack;
+        stack.push(cursor);
+
+        while (!stack.empty()) {
+            const auto current = stack.pop();
+
+            tree.evaluate(current);
+            tree.stats().node_visited();
+
+            const bool proceedPending = for_each_pending(tree, current, [&tree, &search, &visit, sqrRadius](size_t i) {
+                return square_dist(tree, search, i) > sqrRadius || visit(i);
+            });
+            if (!proceedPending)
+                return false;
+
+            auto const& range = current.range;
+
+            if (range.is_leaf()) { // no children, visit all values of bucket within the sphere
+                const bool proceed = scan_bucket(tree, range, search, [&visit, sqrRadius](size_t i, double sqrDistance) {
+                    return sqrDistance > sqrRadius || visit(i);
                 });
-            remove_from(target, maxSize);
+                if (!proceed)
+                    return false;
+                continue;
+            }
+
+            const size_t median = range.median();
+            const Scalar split = tree.coordinate(median, range.dim);
+
+            if (!tree.erased(median) && square_dist(tree, search, median) <= sqrRadius && !visit(median))
+                return false; // visit current node if it is within the search radius
+
+            const double borderNegative = search[range.dim] - radius;
+            const double borderPositive = search[range.dim] + radius;
+
+            // the other side is pushed first, so it is searched afterwards, if
+            // the distance to it is smaller than radius
+            const auto comp = dimension_compare(search, split, range.dim);
+            if (comp == NEGATIVE) {
+                if (!range.positive().is_empty()) {
+                    if (borderPositive >= split)
+                        stack.push(tree.positive(current));
+                    else
+                        tree.stats().node_pruned();
+                }
+                stack.push(tree.negative(current));
+            } else {
+                if (borderNegative <= split)
+                    stack.push(tree.negative(current));
+                else
+                    tree.stats().node_pruned();
+                if (!range.positive().is_empty())
+                    stack.push(tree.positive(current));
+            }
         }
+
+        return true;
     }
 
-    static inline void move_append(std::vector<P>&& from, std::vector<P>& to)
+    template <typename Tree, typename Visit>
+    static bool visit_in_box(Tree& tree, typename Tree::Cursor const& cursor, P const& search, P const& sizes, Visit& visit)
     {
-        if (to.empty()) {
-            to = std::move(from);
-            return;
+        TraversalStack<typename Tree::Cursor> stack;
+        stack.push(cursor);
+
+        while (!stack.empty()) {
+            const auto current = stack.pop();
+
+            tree.evaluate(current);
+            tree.stats().node_visited();
+
+            const bool proceedPending = for_each_pending(tree, current, [&tree, &search, &sizes, &visit](size_t i) {
+                return !is_in_box(tree, search, sizes, i) || visit(i);
+            });
+            if (!proceedPending)
+                return false;
+
+            auto const& range = current.range;
+
+            if (range.is_leaf()) { // no children, visit all values of bucket within the box
+                if (!scan_bucket_in_box(tree, range, search, sizes, visit))
+                    return false;
+                continue;
+            }
+
+            const size_t median = range.median();
+            const Scalar split = tree.coordinate(median, range.dim);
+
+            if (!tree.erased(median) && is_in_box(tree, search, sizes, median) && !visit(median))
+                return false;
+
+            const double borderNegative = search[range.dim] - 0.5 * sizes[range.dim];
+            const double borderPositive = search[range.dim] + 0.5 * sizes[range.dim];
+
+            // the other side is pushed first, so it is searched afterwards, if
+            // the distance to it is smaller than half the box size
+            const auto comp = dimension_compare(search, split, range.dim);
+            if (comp == NEGATIVE) {
+                if (!range.positive().is_empty()) {
+                    if (borderPositive >= split)
+                        stack.push(tree.positive(current));
+                    else
+                        tree.stats().node_pruned();
+                }
+                stack.push(tree.negative(current));
+            } else {
+                if (borderNegative <= split)
+                    stack.push(tree.negative(current));
+                else
+                    tree.stats().node_pruned();
+                if (!range.positive().is_empty())
+                    stack.push(tree.positive(current));
+            }
         }
 
-        to.reserve(to.size() + from.size());
-        to.insert(
-            std::end(to),
-            std::make_move_iterator(std::begin(from)),
-            std::make_move_iterator(std::end(from)));
+        return true;
     }
 
-    static inline void remove_from(std::vector<P>& x, size_t index)
+    // calls f(position) for the inserted points of the subtree, until f returns false
+    template <typename Tree, typename F>
+    static inline bool for_each_pending(Tree& tree, typename Tree::Cursor const& cursor, F const& f)
     {
-        if (x.size() < index)
-            return;
-        x.erase(x.begin() + index, x.end());
+        std::vector<size_t> const* pending = tree.pending(cursor);
+        if (!pending)
+            return true;
+
+        for (const auto i : *pending) {
+            if (!f(i))
+                return false;
+        }
+        return true;
     }
-};
 
-///@todo maybe own file (or rename this file to KdTree)
-template <typename P>
-class StrictKdTree {
-private:
-    mutable LazyKdTree<P> lkd;
+//------------------------------------------------------------------------------
 
-public:
-    StrictKdTree(std::vector<P>&& in)
-        : lkd(std::move(in), 0)
+    // whether the bucket is scanned by the SIMD kernels
+    // they are only enabled by defining LAZYTREES_SIMD_BUCKETS, since they
+    // haven't been faster than the scalar loop in the benchmark yet
+    // they only read coordinates stored contiguously as Distance (SoA) in
+    // place, copying them first costs more than it saves, and only buckets of
+    // at least one full block are worth it
+    template <typename Tree>
+    static inline bool is_simd_scanned(Tree& tree, Range const& range)
     {
-        lkd.ensure_evaluated_fully();
+        return simd_enabled() && range.size() >= SimdBlockSize && as_distances(tree.coordinates(range.dim));
     }
 
-    StrictKdTree(std::vector<P> const& in)
-        : lkd(in, 0)
+    static inline bool simd_enabled()
     {
-        lkd.ensure_evaluated_fully();
+#ifdef LAZYTREES_SIMD_BUCKETS
+        return true;
+#else
+        return false;
+#endif
     }
 
+    static inline Distance const* as_distances(Distance const* coords)
+    {
+        return coords;
+    }
 
-    StrictKdTree(LazyKdTree<P>&& in)
-        : lkd(std::move(in))
+    template <typename T>
+    static inline Distance const* as_distances(T const*)
     {
-        lkd.ensure_evaluated_fully();
+        return nullptr; // stored as another type, has to be converted
     }
 
-    inline P nearest(P const& search) const
+    // calls f(position, sqrDistance) for the points of the bucket, until f returns false
+    template <typename Tree, typename F>
+    static bool scan_bucket(Tree& tree, Range const& range, P const& search, F const& f)
     {
-        return lkd.nearest(search);
+        if (!is_simd_scanned(tree, range)) {
+            for (size_t i = range.begin; i < range.end; ++i) {
+                if (!tree.erased(i) && !f(i, square_dist(tree, search, i)))
+                    return false;
+            }
+            return true;
+        }
+
+        Distance sqrDists[SimdBlockSize];
+
+        for (size_t begin = range.begin; begin < range.end; begin += SimdBlockSize) {
+            const size_t n = std::min(SimdBlockSize, range.end - begin);
+
+            std::fill(sqrDists, sqrDists + n, Distance(0));
+            for (size_t d = 0; d < Traits::dimensions(); ++d)
+                add_square_diffs(sqrDists, as_distances(tree.coordinates(d)) + begin, Distance(search[d]), n);
+
+            for (size_t i = 0; i < n; ++i) {
+                tree.stats().distance_computed();
+                if (!tree.erased(begin + i) && !f(begin + i, sqrDists[i]))
+                    return false;
+            }
+        }
+
+        return true;
     }
 
-    inline std::vector<P> k_nearest(P const& search, size_t n) const
+    // calls visit(position) for the points of the bucket within the box, until visit returns false
+    template <typename Tree, typename Visit>
+    static bool scan_bucket_in_box(Tree& tree, Range const& range, P const& search, P const& sizes, Visit& visit)
     {
-        return lkd.k_nearest(search, n);
+        if (!is_simd_scanned(tree, range)) {
+            for (size_t i = range.begin; i < range.end; ++i) {
+                if (!tree.erased(i) && is_in_box(tree, search, sizes, i) && !visit(i))
+                    return false;
+            }
+            return true;
+        }
+
+        Distance excess[SimdBlockSize];
+
+        for (size_t begin = range.begin; begin < range.end; begin += SimdBlockSize) {
+            const size_t n = std::min(SimdBlockSize, range.end - begin);
+
+            std::fill(excess, excess + n, std::numeric_limits<Distance>::lowest());
+            for (size_t d = 0; d < Traits::dimensions(); ++d)
+                max_box_excess(excess, as_distances(tree.coordinates(d)) + begin, Distance(search[d]), Distance(0.5 * sizes[d]), n);
+
+            for (size_t i = 0; i < n; ++i) {
+                tree.stats().distance_computed();
+                if (excess[i] <= 0 && !tree.erased(begin + i) && !visit(begin + i))
+                    return false;
+            }
+        }
+
+        return true;
     }
 
-    inline std::vector<P> in_hypersphere(P const& search, double radius) const
+    // the distance tests of the queries, reported to the observer of tree
+    // the number of dimensions is a constant if known at compile time, so the
+    // loops can be unrolled and vectorized
+    template <typename Tree>
+    static inline bool is_in_box(Tree& tree, P const& search, P const& sizes, size_t position)
     {
-        return lkd.in_hypersphere(search, radius);
+        tree.stats().distance_computed();
+
+        for (size_t i = 0; i < Traits::dimensions(); ++i) {
+            if (dimension_dist(tree, search, position, i) > Distance(0.5 * sizes[i]))
+                return false;
+        }
+        return true;
+    }
+
+    template <typename Tree>
+    static inline double square_dist(Tree& tree, P const& search, size_t position)
+    {
+        tree.stats().distance_computed();
+
+        Distance sqrDist(0);
+        const size_t nDims = Traits::dimensions();
+
+        for (size_t i = 0; i < nDims; ++i) {
+            const Distance diff = Distance(search[i]) - Distance(tree.coordinate(position, i));
+            sqrDist += diff * diff;
+        }
+
+        return sqrDist;
+    }
+
+    template <typename Tree>
+    static inline Distance dimension_dist(Tree& tree, P const& search, size_t position, size_t dim)
+    {
+        return std::fabs(Distance(search[dim]) - Distance(tree.coordinate(position, dim)));
+    }
+
+    static inline Compare dimension_compare(P const& search, Scalar split, size_t dim)
+    {
+        if (search[dim] <= split)
+            return NEGATIVE;
+
+        return POSITIVE;
+    }
+
+    template <typename F>
+    static inline auto call_visitor(F& f, P const& p)
+        -> typename std::enable_if<std::is_same<decltype(f(p)), bool>::value, bool>::type
+    {
+        return f(p);
+    }
+
+    template <typename F>
+    static inline auto call_visitor(F& f, P const& p)
+        -> typename std::enable_if<!std::is_same<decltype(f(p)), bool>::value, bool>::type
+    {
+        f(p);
+        return true;
+    }
+};
+
+}
+
+//------------------------------------------------------------------------------
+
+// yields the points of a tree in increasing distance to a search point
+// (see nearest_iterator() of the trees), without knowing up front how many
+// will be needed:
+//   for (auto it = tree.nearest_iterator(search); !it.done(); ++it)
+//       if (accept(*it)) break;
+// the tree must outlive the iterator, other queries may run in between
+template <typename P, size_t BucketSize, typename Tree>
+class NearestIterator {
+private:
+    typedef typename detail::KdSearch<P, BucketSize>::template Frontier<typename Tree::Cursor> Frontier;
+
+    Tree* tree;
+    Frontier frontier;
+    size_t position;
+    double sqrDistance;
+    bool valid;
+
+public:
+    NearestIterator(Tree& tree, Frontier&& frontier)
+        : tree(&tree)
+        , frontier(std::move(frontier))
+        , position(0)
+        , sqrDistance(0.0)
+        , valid(false)
+    {
+        ++*this;
+    }
+
+    // whether all points have been returned
+    inline bool done() const
+    {
+        return !valid;
+    }
+
+    inline P const& operator*() const
+    {
+        return tree->point(position);
+    }
+
+    inline P const* operator->() const
+    {
+        return &tree->point(position);
+    }
+
+    // the index the current point had within the input of the tree
+    inline size_t index() const
+    {
+        return tree->index(position);
+    }
+
+    inline double distance() const
+    {
+        return std::sqrt(sqrDistance);
+    }
+
+    inline NearestIterator& operator++()
+    {
+        valid = tree->next_nearest(frontier, position, sqrDistance);
+        return *this;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+template <typename P, size_t BucketSize, typename Stats, typename Layout>
+class StrictKdTree;
+
+template <typename P, size_t BucketSize>
+class DynamicKdForest;
+
+//------------------------------------------------------------------------------
+
+// how much of a LazyKdTree has been evaluated so far (see LazyKdTree::coverage())
+// leaf buckets are never partitioned, their points count as evaluated
+struct EvaluationCoverage {
+    size_t nodesEvaluated;                // partitioned subtrees
+    size_t subtreesUnevaluated;           // subtrees still waiting to be partitioned
+    size_t pointsUnevaluated;             // points within these subtrees
+    size_t pointsPending;                 // inserted points not yet placed within the tree (see LazyKdTree::insert())
+    size_t pointsErased;                  // erased points still held until the next compaction
+    size_t bytesUnevaluated;              // memory held by these points (and their indices)
+    size_t bytesUsed;                     // memory of the whole tree
+    std::vector<size_t> nodesPerDepth;    // nodesPerDepth[d] evaluated nodes at depth d
+
+    inline double fraction_evaluated(size_t nPoints) const
+    {
+        return 1.0 - static_cast<double>(pointsUnevaluated) / nPoints;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+// P must implement static size_t dimensions() returning number of dimensions
+// P also must be const random-accessable for up to [dimensions() - 1] returning
+// the X / Y / Z / ... coordinate of the point
+// the coordinates may be of any arithmetic type, if dimensions() is constexpr
+// the distance computations are specialized for it (see PointTraits.h)
+// subtrees with up to BucketSize points aren't split any further, but scanned
+// linearly when queried
+// Stats observes the traversals of the queries (see TraversalStats.h)
+// Layout defines how the points are stored, AoS, SoA or View (see PointStorage.h)
+template <typename P, size_t BucketSize = 1, typename Stats = NoStats, typename Layout = AoS>
+class LazyKdTree {
+private:
+    friend class detail::KdSearch<P, BucketSize>;
+    friend class NearestIterator<P, BucketSize, LazyKdTree>;
+    template <typename, size_t, typename, typename> friend class StrictKdTree;
+    template <typename, size_t> friend class DynamicKdForest;
+
+    typedef detail::Range<P, BucketSize> Range;
+    typedef detail::KdSearch<P, BucketSize> Search;
+    typedef detail::QueryScope<Stats> Scope;
+    typedef detail::Storage<P, Layout> Storage;
+    typedef typename Storage::Scalar Scalar;
+
+    // the ranges are implicit, therefore a Node only exists once evaluated
+    // nodes are created within the pool of the tree and released with it
+    struct Node {
+        Node* childNegative;
+        Node* childPositive;
+    };
+
+    struct Cursor {
+        Node** node;
+        Range range;
+        size_t depth;
+    };
+
+    // evaluates distinct subtrees concurrently, the coverage is counted afterwards
+    // only the creation of the nodes is synchronized
+    struct ParallelEvaluator {
+        typedef LazyKdTree::Cursor Cursor;
+
+        LazyKdTree& tree;
+
+        std::mutex& mutex;
+
+        inline void evaluate(Cursor const& cursor)
+        {
+            tree.partition(cursor, [this]() {
+                std::lock_guard<std::mutex> lock(mutex);
+                return tree.nodes.create();
+            });
+        }
+
+        inline Cursor negative(Cursor const& cursor) const
+        {
+            return tree.negative(cursor);
+        }
+
+        inline Cursor positive(Cursor const& cursor) const
+        {
+            return tree.positive(cursor);
+        }
+    };
+
+    Storage storage;
+
+    detail::NodePool<Node> nodes;
+
+    Node* root;
+
+    const size_t dim;
+
+    // the tree covers the first nPlaced points of storage, the inserted ones
+    // after them are kept in lists of the subtrees they belong to, keyed by
+    // the slots of these subtrees (see pending_key())
+    size_t nPlaced, nPending;
+    std::unordered_map<Node**, std::vector<size_t> > pendingLists;
+
+    // erased points are marked within storage until it is compacted
+    size_t nErased;
+
+    Stats queryStats, totalStats;
+
+    // maintained by evaluate(), so coverage() doesn't have to walk the tree
+    size_t nNodes, nUnevaluated, nPointsUnevaluated;
+    std::vector<size_t> nodesPerDepth;
+
+//------------------------------------------------------------------------------
+
+public:
+    LazyKdTree(std::vector<P>&& in, int dimension = 0)
+        : storage(std::move(in))
+        , nodes()
+        , root(nullptr)
+        , dim(dimension % PointTraits<P>::dimensions())
+        , nPlaced(storage.size())
+        , nPending(0)
+        , pendingLists()
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+        , nNodes(0)
+        , nUnevaluated(0)
+        , nPointsUnevaluated(0)
+        , nodesPerDepth()
+    {
+      throw_if_input_empty();
+      init_coverage();
+    }
+
+    LazyKdTree(std::vector<P> const& in, int dimension = 0)
+        : storage(in)
+        , nodes()
+        , root(nullptr)
+        , dim(dimension % PointTraits<P>::dimensions())
+        , nPlaced(storage.size())
+        , nPending(0)
+        , pendingLists()
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+        , nNodes(0)
+        , nUnevaluated(0)
+        , nPointsUnevaluated(0)
+        , nodesPerDepth()
+    {
+      throw_if_input_empty();
+      init_coverage();
+    }
+
+    // indexes the points of view in place, which requires Layout View
+    // the points must outlive the tree (see PointView)
+    LazyKdTree(PointView<P> view, int dimension = 0)
+        : storage(view)
+        , nodes()
+        , root(nullptr)
+        , dim(dimension % PointTraits<P>::dimensions())
+        , nPlaced(storage.size())
+        , nPending(0)
+        , pendingLists()
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+        , nNodes(0)
+        , nUnevaluated(0)
+        , nPointsUnevaluated(0)
+        , nodesPerDepth()
+    {
+      throw_if_input_empty();
+      init_coverage();
+    }
+
+    // the tree saved to file (see save()), with the same subtrees evaluated
+    // and the same points inserted and erased
+    // its points are copied, since evaluating the tree further moves them
+    explicit LazyKdTree(MappedFile const& file)
+        : LazyKdTree(file, detail::read_tree_file_header<P>(file))
+    {}
+
+    LazyKdTree(LazyKdTree&&) = default;
+
+    ///@todo maybe write impl in the future (also implement for strict version then)
+    LazyKdTree(LazyKdTree const&) = delete;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    LazyKdTree(MappedFile const& file, detail::TreeFileHeader const& header)
+        : storage(detail::saved_points<P>(file, header), detail::saved_indices(file, header),
+                  detail::saved_erased(file, header), header.nextIndex)
+        , nodes()
+        , root(nullptr)
+        , dim(header.dim % PointTraits<P>::dimensions())
+        , nPlaced(header.nPlaced)
+        , nPending(0)
+        , pendingLists()
+        , nErased(header.nErased)
+        , queryStats()
+        , totalStats()
+        , nNodes(0)
+        , nUnevaluated(0)
+        , nPointsUnevaluated(0)
+        , nodesPerDepth()
+    {
+        throw_if_input_empty();
+
+        // the evaluated subtrees only match the leaf buckets they were saved with
+        if (header.nodesBytes > 0 ? header.bucketSize != BucketSize : header.bucketSize > BucketSize)
+            throw std::runtime_error("LazyKdTree was saved with a different BucketSize");
+
+        restore_nodes(header.nodesOffset ? reinterpret_cast<unsigned char const*>(file.data() + header.nodesOffset) : nullptr,
+            header.nodesBytes);
+        restore_pending();
+    }
+
+    inline void throw_if_input_empty() const
+    {
+      if (storage.size() == 0)
+        throw std::logic_error("LazyKdTree can't be constructed from empty inputs");
+    }
+
+    inline void throw_if_all_erased() const
+    {
+      if (size() == 0)
+        throw std::logic_error("LazyKdTree has no points left after erasing");
+    }
+
+    inline void init_coverage()
+    {
+        const Range range = root_cursor().range;
+        nUnevaluated = range.is_leaf() ? 0 : 1;
+        nPointsUnevaluated = range.is_leaf() ? 0 : range.size();
+    }
+
+    inline void count_node(size_t depth)
+    {
+        ++nNodes;
+        if (nodesPerDepth.size() <= depth)
+            nodesPerDepth.resize(depth + 1, 0);
+        ++nodesPerDepth[depth];
+    }
+
+    // the coverage of the fully evaluated subtree of range
+    void count_coverage(Range const& range, size_t depth)
+    {
+        detail::TraversalStack<std::pair<Range, size_t> > stack;
+        stack.push(std::make_pair(range, depth));
+
+        while (!stack.empty()) {
+            const auto current = stack.pop();
+            if (current.first.is_leaf())
+                continue;
+
+            count_node(current.second);
+
+            stack.push(std::make_pair(current.first.positive(), current.second + 1));
+            stack.push(std::make_pair(current.first.negative(), current.second + 1));
+        }
+    }
+
+    // the subtree of cursor has just been evaluated
+    inline void update_coverage(Cursor const& cursor)
+    {
+        count_node(cursor.depth);
+
+        // the median is placed, children which are leaves are done as well
+        --nUnevaluated;
+        --nPointsUnevaluated;
+        for (auto const& child : { cursor.range.negative(), cursor.range.positive() }) {
+            if (child.is_leaf())
+                nPointsUnevaluated -= child.size();
+            else
+                ++nUnevaluated;
+        }
+    }
+
+    inline Cursor root_cursor()
+    {
+        return Cursor{ &root, Range{ 0, nPlaced, dim }, 0 };
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return storage.point(position);
+    }
+
+    inline Scalar coordinate(size_t position, size_t dimension) const
+    {
+        return storage.coordinate(position, dimension);
+    }
+
+    inline Scalar const* coordinates(size_t dimension) const
+    {
+        return storage.coordinates(dimension);
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return storage.index(position);
+    }
+
+    inline Stats& stats()
+    {
+        return queryStats;
+    }
+
+    inline bool erased(size_t position) const
+    {
+        return storage.is_erased(position);
+    }
+
+    inline std::vector<size_t> const* pending(Cursor const& cursor) const
+    {
+        if (pendingLists.empty())
+            return nullptr;
+
+        const auto it = pendingLists.find(pending_key(cursor.node));
+        return it == pendingLists.end() ? nullptr : &it->second;
+    }
+
+    void evaluate(Cursor const& cursor)
+    {
+        if (partition(cursor, [this]() { return nodes.create(); }))
+            update_coverage(cursor);
+    }
+
+    // returns whether the subtree had to be partitioned, its node is created
+    // by create()
+    template <typename Create>
+    bool partition(Cursor const& cursor, Create const& create)
+    {
+        Node*& node = *cursor.node;
+
+        if (node || cursor.range.is_leaf())
+            return false; // already evaluated or nothing to partition
+
+        queryStats.points_moved(Search::median_dimension_sort(storage, cursor.range));
+        queryStats.node_evaluated();
+        node = create();
+        distribute_pending(cursor);
+        return true;
+    }
+
+    // moves the inserted points of a just evaluated subtree to its children
+    // if the positive child is empty, the points beyond the split stay
+    void distribute_pending(Cursor const& cursor)
+    {
+        if (pendingLists.empty())
+            return;
+
+        const auto it = pendingLists.find(pending_key(cursor.node));
+        if (it == pendingLists.end())
+            return;
+
+        std::vector<size_t> points;
+        points.swap(it->second);
+        pendingLists.erase(it);
+
+        auto const& range = cursor.range;
+        const Scalar split = coordinate(range.median(), range.dim);
+
+        for (const auto position : points) {
+            if (coordinate(position, range.dim) <= split)
+                pendingLists[&(*cursor.node)->childNegative].push_back(position);
+            else if (!range.positive().is_empty())
+                pendingLists[&(*cursor.node)->childPositive].push_back(position);
+            else
+                pendingLists[pending_key(cursor.node)].push_back(position);
+        }
+    }
+
+    void erase_at(size_t position)
+    {
+        if (position >= nPlaced) { // not placed yet, remove it from its list
+            const auto it = pendingLists.find(pending_key(pending_cursor(position).node));
+            if (it == pendingLists.end())
+                throw std::logic_error("an inserted point isn't kept by its subtree");
+            auto& points = it->second;
+            points.erase(std::find(points.begin(), points.end(), position));
+            if (points.empty())
+                pendingLists.erase(it);
+            --nPending;
+        }
+
+        storage.erase(position);
+        ++nErased;
+    }
+
+    // the slots of the children are part of their parent nodes, which never
+    // move, but the slot of the root is a member of the tree, so its list is
+    // keyed by nullptr to remain valid once the tree is moved
+    inline Node** pending_key(Node** slot) const
+    {
+        return slot == &root ? nullptr : slot;
+    }
+
+    // the subtree an inserted point at position belongs to, the first one
+    // not evaluated yet on its path
+    inline Cursor pending_cursor(size_t position)
+    {
+        Cursor cursor = root_cursor();
+
+        while (*cursor.node) { // evaluated subtrees are never leaves
+            auto const& range = cursor.range;
+            const Scalar split = coordinate(range.median(), range.dim);
+
+            if (coordinate(position, range.dim) <= split)
+                cursor = negative(cursor);
+            else if (!range.positive().is_empty())
+                cursor = positive(cursor);
+            else
+                break;
+        }
+
+        return cursor;
+    }
+
+    // the most inserted points a subtree keeps, about as many as it has
+    // itself, so evaluating it is paid for by the insertions
+    static inline size_t pending_limit(Range const& range)
+    {
+        return std::max(range.size(), pending_factor() * BucketSize);
+    }
+
+    static inline size_t pending_factor()
+    {
+        return 8;
+    }
+
+    // evaluates the subtree at cursor while it keeps too many inserted
+    // points, passing them on to the children, and the children as well
+    // only if they can't be passed on any further (leaf buckets, or the
+    // points beyond the split of an evaluated subtree without positive
+    // child), all points are placed within a new unevaluated tree
+    void pass_on_pending(Cursor const& cursor)
+    {
+        std::vector<Cursor> overflowing(1, cursor);
+
+        while (!overflowing.empty()) {
+            const Cursor current = overflowing.back();
+            overflowing.pop_back();
+
+            const auto it = pendingLists.find(pending_key(current.node));
+            if (it == pendingLists.end() || it->second.size() <= pending_limit(current.range))
+                continue;
+
+            if (*current.node || current.range.is_leaf()) {
+                rebuild();
+                return;
+            }
+
+            evaluate(current);
+            overflowing.push_back(negative(current));
+            if (!current.range.positive().is_empty())
+                overflowing.push_back(positive(current));
+        }
+    }
+
+    // once this fraction of the points is erased, they are removed for good
+    static inline size_t compaction_ratio()
+    {
+        return 4;
+    }
+
+    inline void compact_if_needed()
+    {
+        if (nErased * compaction_ratio() > storage.size())
+            rebuild();
+    }
+
+    // places all points within a new, completely unevaluated tree, removing
+    // the erased ones
+    // the evaluated subtrees can't be kept, since placing or removing points
+    // shifts the ranges of all subtrees behind them, so this costs O(n) and
+    // the following queries evaluate their paths again
+    void rebuild()
+    {
+        root = nullptr;
+        nodes.clear();
+        pendingLists.clear();
+        storage.compact();
+        nPlaced = storage.size();
+        nPending = 0;
+        nErased = 0;
+
+        nNodes = 0;
+        nodesPerDepth.clear();
+        init_coverage();
+    }
+
+    // the evaluated subtrees in preorder, as saved (see detail::TreeFileHeader)
+    // empty if all subtrees are evaluated
+    std::vector<unsigned char> evaluated_nodes() const
+    {
+        std::vector<unsigned char> evaluated;
+        if (nUnevaluated == 0)
+            return evaluated;
+
+        detail::TraversalStack<std::pair<Range, Node const*> > stack;
+        stack.push(std::make_pair(Range{ 0, nPlaced, dim }, static_cast<Node const*>(root)));
+
+        while (!stack.empty()) {
+            const auto current = stack.pop();
+            if (current.first.is_leaf())
+                continue;
+
+            evaluated.push_back(current.second ? 1 : 0);
+            if (current.second) {
+                stack.push(std::make_pair(current.first.positive(), static_cast<Node const*>(current.second->childPositive)));
+                stack.push(std::make_pair(current.first.negative(), static_cast<Node const*>(current.second->childNegative)));
+            }
+        }
+
+        return evaluated;
+    }
+
+    // creates the nodes of the saved evaluated subtrees, whose points are
+    // already in their evaluated order, all subtrees if evaluated is nullptr
+    void restore_nodes(unsigned char const* evaluated, size_t nBytes)
+    {
+        size_t i = 0;
+        detail::TraversalStack<Cursor> stack;
+        stack.push(root_cursor());
+
+        while (!stack.empty()) {
+            const Cursor cursor = stack.pop();
+            if (cursor.range.is_leaf())
+                continue;
+
+            if (evaluated) {
+                if (i == nBytes)
+                    throw std::runtime_error("the saved tree is truncated or corrupted");
+                if (!evaluated[i++]) {
+                    ++nUnevaluated;
+                    nPointsUnevaluated += cursor.range.size();
+                    continue;
+                }
+            }
+
+            *cursor.node = nodes.create();
+            count_node(cursor.depth);
+            stack.push(positive(cursor));
+            stack.push(negative(cursor));
+        }
+
+        if (i != nBytes)
+            throw std::runtime_error("the saved tree is truncated or corrupted");
+    }
+
+    // the inserted points are kept with their subtrees again
+    void restore_pending()
+    {
+        for (size_t position = nPlaced; position < storage.size(); ++position) {
+            if (storage.is_erased(position))
+                continue;
+            pendingLists[pending_key(pending_cursor(position).node)].push_back(position);
+            ++nPending;
+        }
+    }
+
+    inline Cursor negative(Cursor const& cursor)
+    {
+        return Cursor{ &(*cursor.node)->childNegative, cursor.range.negative(), cursor.depth + 1 };
+    }
+
+    inline Cursor positive(Cursor const& cursor)
+    {
+        return Cursor{ &(*cursor.node)->childPositive, cursor.range.positive(), cursor.depth + 1 };
+    }
+
+    // a step of a NearestIterator, counting as a query for the stats
+    // evaluating further subtrees never moves the points the frontier refers
+    // to, since those are medians of evaluated subtrees or within leaf buckets
+    bool next_nearest(typename Search::template Frontier<Cursor>& frontier, size_t& position, double& sqrDistance)
+    {
+        Scope scope(queryStats, totalStats);
+        return Search::next_nearest(*this, frontier, position, sqrDistance);
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+public:
+
+    // evaluates the tree using threadCount threads
+    // trees with an observer (Stats) are always evaluated by a single thread
+    // inserted points are placed within the tree and erased ones removed first
+    void ensure_evaluated_fully(size_t threadCount = 1)
+    {
+        Scope scope(queryStats, totalStats);
+
+        if (nPending > 0 || nErased > 0)
+            rebuild();
+
+        const size_t nThreads = detail::observed_thread_count<Stats>(threadCount);
+
+        if (nThreads <= 1) {
+            Search::evaluate_fully(*this, root_cursor());
+            return;
+        }
+
+        std::mutex mutex;
+        ParallelEvaluator evaluator{ *this, mutex };
+        Search::evaluate_fully(evaluator, root_cursor(), nThreads);
+
+        nNodes = nUnevaluated = nPointsUnevaluated = 0;
+        nodesPerDepth.clear();
+        count_coverage(root_cursor().range, 0);
+    }
+
+//------------------------------------------------------------------------------
+
+    P nearest(P const& search)
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return point(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // the index the nearest point had within the input of the tree
+    size_t nearest_index(P const& search)
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return index(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // approximate nearest neighbor, at most (1 + eps) times as far away as the
+    // exact one, backtracking stops after maxVisited subtrees were visited
+    // this also evaluates fewer subtrees
+    P nearest_approx(P const& search, double eps, size_t maxVisited = std::numeric_limits<size_t>::max())
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return point(Search::nearest(*this, root_cursor(), search, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+    // all points in increasing distance to search (see NearestIterator)
+    // subtrees are only evaluated once the iteration reaches them
+    NearestIterator<P, BucketSize, LazyKdTree> nearest_iterator(P const& search)
+    {
+        return NearestIterator<P, BucketSize, LazyKdTree>(*this,
+            typename Search::template Frontier<Cursor>(root_cursor(), search));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> k_nearest(P const& search, size_t n)
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    std::vector<size_t> k_nearest_indices(P const& search, size_t n)
+    {
+        if (n < 1) return std::vector<size_t>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    // see nearest_approx(), might return fewer than n points if maxVisited is reached
+    std::vector<P> k_nearest_approx(P const& search, size_t n, double eps, size_t maxVisited = std::numeric_limits<size_t>::max())
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this,
+            Search::k_nearest(*this, root_cursor(), search, n, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> in_hypersphere(P const& search, double radius)
+    {
+        if (radius <= 0.0) return std::vector<P>(); // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
+    }
+
+    std::vector<size_t> in_hypersphere_indices(P const& search, double radius)
+    {
+        if (radius <= 0.0) return std::vector<size_t>(); // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
+    }
+
+//------------------------------------------------------------------------------
+
+    std::vector<P> in_box(P const& search, P const& sizes)
+    {
+        if (!Search::is_valid_box(sizes))
+            return std::vector<P>(); // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+    std::vector<size_t> in_box_indices(P const& search, P const& sizes)
+    {
+        if (!Search::is_valid_box(sizes))
+            return std::vector<size_t>(); // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+//------------------------------------------------------------------------------
+
+    // calls f(point) for every point within the sphere / box, without creating
+    // any container, f may return false to stop the search
+    template <typename F>
+    void for_each_in_hypersphere(P const& search, double radius, F&& f)
+    {
+        if (radius <= 0.0) return; // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        Search::for_each_in_hypersphere(*this, root_cursor(), search, radius, f);
+    }
+
+    template <typename F>
+    void for_each_in_box(P const& search, P const& sizes, F&& f)
+    {
+        if (!Search::is_valid_box(sizes))
+            return; // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        Search::for_each_in_box(*this, root_cursor(), search, sizes, f);
+    }
+
+    // write all points within the sphere / box to out
+    template <typename OutputIt>
+    OutputIt in_hypersphere(P const& search, double radius, OutputIt out)
+    {
+        for_each_in_hypersphere(search, radius, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+    template <typename OutputIt>
+    OutputIt in_box(P const& search, P const& sizes, OutputIt out)
+    {
+        for_each_in_box(search, sizes, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+//------------------------------------------------------------------------------
+
+    // the batch queries process all searches at once, which is faster than
+    // querying them one by one, results[i] being the result for searches[i]
+    // a batch counts as a single query for the stats
+    void nearest_batch(std::vector<P> const& searches, std::vector<P>& results)
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        Search::nearest_batch(*this, root_cursor(), searches, results, 1);
+    }
+
+    void k_nearest_batch(std::vector<P> const& searches, size_t n, std::vector<std::vector<P> >& results)
+    {
+        Scope scope(queryStats, totalStats);
+        Search::k_nearest_batch(*this, root_cursor(), searches, n, results, 1);
+    }
+
+    void in_hypersphere_batch(std::vector<P> const& searches, double radius, std::vector<std::vector<P> >& results)
+    {
+        Scope scope(queryStats, totalStats);
+        Search::in_hypersphere_batch(*this, root_cursor(), searches, radius, results, 1);
+    }
+
+    void in_box_batch(std::vector<P> const& searches, P const& sizes, std::vector<std::vector<P> >& results)
+    {
+        Scope scope(queryStats, totalStats);
+        Search::in_box_batch(*this, root_cursor(), searches, sizes, results, 1);
+    }
+
+//------------------------------------------------------------------------------
+
+    // adds p, it is kept with the first unevaluated subtree (or the leaf
+    // bucket) on its path and scanned linearly by queries reaching that
+    // subtree, evaluating it passes p on to the children
+    // once a subtree keeps too many points that way, it is evaluated right
+    // away (see pass_on_pending()), once there are more inserted points than
+    // placed ones, all points are placed within a new unevaluated tree
+    // inserting invalidates the NearestIterators of the tree
+    void insert(P const& p)
+    {
+        static_assert(!std::is_same<Layout, View>::value, "points can't be inserted into the view of the caller");
+
+        const size_t position = storage.size();
+        storage.append(p);
+
+        const Cursor cursor = pending_cursor(position);
+        pendingLists[pending_key(cursor.node)].push_back(position);
+        ++nPending;
+
+        if (nPending > nPlaced) {
+            rebuild();
+            return;
+        }
+
+        Scope scope(queryStats, totalStats);
+        pass_on_pending(cursor);
+    }
+
+    template <typename InputIt>
+    void insert(InputIt first, InputIt last)
+    {
+        for (; first != last; ++first)
+            insert(*first);
+    }
+
+    // erases all points with the coordinates of p, returning their number
+    // points within the tree are only marked as erased and skipped by queries,
+    // inserted points which aren't placed yet are removed right away
+    // once a quarter of the points is erased, the tree is rebuilt without them
+    // erasing invalidates the NearestIterators of the tree
+    size_t erase(P const& p)
+    {
+        Scope scope(queryStats, totalStats);
+
+        const auto positions = Search::in_hypersphere(*this, root_cursor(), p, 0.0);
+        for (const auto position : positions)
+            erase_at(position);
+
+        compact_if_needed();
+        return positions.size();
+    }
+
+    // erases all points for which pred(point) returns true, returning their number
+    template <typename Pred>
+    size_t erase_if(Pred pred)
+    {
+        size_t n = 0;
+        for (size_t i = 0; i < storage.size(); ++i) {
+            if (!storage.is_erased(i) && pred(storage.point(i))) {
+                erase_at(i);
+                ++n;
+            }
+        }
+
+        compact_if_needed();
+        return n;
+    }
+
+//------------------------------------------------------------------------------
+
+    // writes the tree as it is, the evaluated subtrees in their evaluated order
+    // and the others as raw ranges of points, LazyKdTree(MappedFile const&)
+    // resumes with the same tree, without evaluating anything again
+    // fully evaluated trees without inserted points can also be mapped by
+    // StrictKdTree, P must be trivially copyable (see StrictKdTree::save())
+    void save(std::ostream& out) const
+    {
+        const auto evaluated = evaluated_nodes();
+        detail::write_tree_file<P>(out, storage, detail::tree_file_header<P>(BucketSize, dim, storage.size(),
+            nPlaced, nErased, storage.next_index(), evaluated.size()), evaluated);
+    }
+
+    void save(std::string const& path) const
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        if (!out)
+            throw std::runtime_error("LazyKdTree can't write " + path);
+        save(out);
+    }
+
+//------------------------------------------------------------------------------
+
+    // the stats of the last query / summed over all queries since the last reset
+    Stats const& query_stats() const
+    {
+        return queryStats;
+    }
+
+    Stats const& total_stats() const
+    {
+        return totalStats;
+    }
+
+    void reset_stats()
+    {
+        queryStats = Stats();
+        totalStats = Stats();
+    }
+
+//------------------------------------------------------------------------------
+
+    // how much of the tree has been evaluated so far, without walking the tree
+    EvaluationCoverage coverage() const
+    {
+        EvaluationCoverage res;
+        res.nodesEvaluated      = nNodes;
+        res.subtreesUnevaluated = nUnevaluated;
+        res.pointsUnevaluated   = nPointsUnevaluated;
+        res.pointsPending       = nPending;
+        res.pointsErased        = nErased;
+        res.bytesUnevaluated    = nPointsUnevaluated * Storage::bytes_per_point();
+        res.bytesUsed           = sizeof(*this)
+                                + storage.bytes()
+                                + nodes.bytes()
+                                + nPending * sizeof(size_t)
+                                + nodesPerDepth.capacity() * sizeof(size_t);
+        res.nodesPerDepth       = nodesPerDepth;
+        return res;
+    }
+
+//------------------------------------------------------------------------------
+
+    // the number of points which aren't erased
+    size_t size() const
+    {
+        return storage.size() - nErased;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+// the fully evaluated version of LazyKdTree
+// no nodes are stored at all, the tree is solely defined by the order of the
+// points within its buffer (see detail::Range)
+// the queries are thread-safe unless they are observed by Stats
+// a saved tree can be loaded without evaluating it again, with Layout Mapped
+// even without copying it (see save())
+template <typename P, size_t BucketSize = 1, typename Stats = NoStats, typename Layout = AoS>
+class StrictKdTree {
+private:
+    friend class detail::KdSearch<P, BucketSize>;
+    friend class NearestIterator<P, BucketSize, const StrictKdTree>;
+
+    typedef detail::Range<P, BucketSize> Range;
+    typedef detail::KdSearch<P, BucketSize> Search;
+    typedef detail::QueryScope<Stats> Scope;
+    typedef detail::Storage<P, Layout> Storage;
+    typedef typename Storage::Scalar Scalar;
+
+    struct Cursor {
+        Range range;
+    };
+
+    Storage storage;
+
+    const size_t dim;
+
+    // erased points are marked within storage until it is compacted
+    size_t nErased;
+
+    mutable Stats queryStats, totalStats;
+
+//------------------------------------------------------------------------------
+
+public:
+    // all constructors evaluate the tree using threadCount threads
+    StrictKdTree(std::vector<P>&& in, size_t threadCount = 1)
+        : storage(std::move(in))
+        , dim(0)
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+    {
+        throw_if_input_empty();
+        Search::evaluate_fully(storage, root_cursor().range, threadCount);
+    }
+
+    StrictKdTree(std::vector<P> const& in, size_t threadCount = 1)
+        : storage(in)
+        , dim(0)
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+    {
+        throw_if_input_empty();
+        Search::evaluate_fully(storage, root_cursor().range, threadCount);
+    }
+
+    // indexes the points of view in place, which requires Layout View
+    // the points must outlive the tree (see PointView)
+    StrictKdTree(PointView<P> view, size_t threadCount = 1)
+        : storage(view)
+        , dim(0)
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+    {
+        throw_if_input_empty();
+        Search::evaluate_fully(storage, root_cursor().range, threadCount);
+    }
+
+    // the already evaluated parts of in are kept, since they share the layout
+    template <typename LazyStats>
+    StrictKdTree(LazyKdTree<P, BucketSize, LazyStats, Layout>&& in, size_t threadCount = 1)
+        : storage(evaluated_storage(in, threadCount))
+        , dim(in.dim)
+        , nErased(0)
+        , queryStats()
+        , totalStats()
+    {}
+
+    // the tree saved to file (see save()), its points are accessed in place
+    // within the mapped file, which requires Layout Mapped
+    // the tree must have been saved with a BucketSize of at most BucketSize
+    explicit StrictKdTree(MappedFile&& file)
+        : storage(std::move(file))
+        , dim(storage.file_header().dim % PointTraits<P>::dimensions())
+        , nErased(storage.file_header().nErased)
+        , queryStats()
+        , totalStats()
+    {
+        throw_if_input_empty();
+        if (!storage.file_header().is_fully_evaluated())
+            throw std::runtime_error("StrictKdTree can only map fully evaluated trees");
+        if (storage.file_header().bucketSize > BucketSize)
+            throw std::runtime_error("StrictKdTree was saved with a larger BucketSize");
+    }
+
+    StrictKdTree(StrictKdTree&&) = default;
+
+    StrictKdTree(StrictKdTree const&) = delete;
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    inline void throw_if_input_empty() const
+    {
+      if (storage.size() == 0)
+        throw std::logic_error("StrictKdTree can't be constructed from empty inputs");
+    }
+
+    inline void throw_if_all_erased() const
+    {
+      if (size() == 0)
+        throw std::logic_error("StrictKdTree has no points left after erasing");
+    }
+
+    // once this fraction of the points is erased, they are removed for good
+    static inline size_t compaction_ratio()
+    {
+        return 4;
+    }
+
+    // the tree is evaluated anew, with a single thread
+    inline void compact_if_needed()
+    {
+        if (nErased * compaction_ratio() <= storage.size())
+            return;
+
+        storage.compact();
+        nErased = 0;
+        Search::evaluate_fully(storage, root_cursor().range);
+    }
+
+    template <typename LazyStats>
+    static inline Storage evaluated_storage(LazyKdTree<P, BucketSize, LazyStats, Layout>& in, size_t threadCount)
+    {
+        in.ensure_evaluated_fully(threadCount);
+        return std::move(in.storage);
+    }
+
+    inline Cursor root_cursor() const
+    {
+        return Cursor{ Range{ 0, storage.size(), dim } };
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return storage.point(position);
+    }
+
+    inline Scalar coordinate(size_t position, size_t dimension) const
+    {
+        return storage.coordinate(position, dimension);
+    }
+
+    inline Scalar const* coordinates(size_t dimension) const
+    {
+        return storage.coordinates(dimension);
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return storage.index(position);
+    }
+
+    inline Stats& stats() const
+    {
+        return queryStats;
+    }
+
+    inline void evaluate(Cursor const&) const
+    {}
+
+    inline std::vector<size_t> const* pending(Cursor const&) const
+    {
+        return nullptr;
+    }
+
+    inline bool erased(size_t position) const
+    {
+        return storage.is_erased(position);
+    }
+
+    inline Cursor negative(Cursor const& cursor) const
+    {
+        return Cursor{ cursor.range.negative() };
+    }
+
+    inline Cursor positive(Cursor const& cursor) const
+    {
+        return Cursor{ cursor.range.positive() };
+    }
+
+    // a step of a NearestIterator, counting as a query for the stats
+    inline bool next_nearest(typename Search::template Frontier<Cursor>& frontier, size_t& position, double& sqrDistance) const
+    {
+        Scope scope(queryStats, totalStats);
+        return Search::next_nearest(*this, frontier, position, sqrDistance);
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+public:
+    inline P nearest(P const& search) const
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return point(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // the index the nearest point had within the input of the tree
+    inline size_t nearest_index(P const& search) const
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return index(Search::nearest(*this, root_cursor(), search));
+    }
+
+    // approximate nearest neighbor, at most (1 + eps) times as far away as the
+    // exact one, backtracking stops after maxVisited subtrees were visited
+    inline P nearest_approx(P const& search, double eps, size_t maxVisited = std::numeric_limits<size_t>::max()) const
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        return point(Search::nearest(*this, root_cursor(), search, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+    // all points in increasing distance to search (see NearestIterator)
+    inline NearestIterator<P, BucketSize, const StrictKdTree> nearest_iterator(P const& search) const
+    {
+        return NearestIterator<P, BucketSize, const StrictKdTree>(*this,
+            typename Search::template Frontier<Cursor>(root_cursor(), search));
+    }
+
+    inline std::vector<P> k_nearest(P const& search, size_t n) const
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    inline std::vector<size_t> k_nearest_indices(P const& search, size_t n) const
+    {
+        if (n < 1) return std::vector<size_t>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::k_nearest(*this, root_cursor(), search, n));
+    }
+
+    // see nearest_approx(), might return fewer than n points if maxVisited is reached
+    inline std::vector<P> k_nearest_approx(P const& search, size_t n, double eps,
+        size_t maxVisited = std::numeric_limits<size_t>::max()) const
+    {
+        if (n < 1) return std::vector<P>(); // no real search if n < 1
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this,
+            Search::k_nearest(*this, root_cursor(), search, n, detail::Limits::approximate(eps, maxVisited)));
+    }
+
+    inline std::vector<P> in_hypersphere(P const& search, double radius) const
+    {
+        if (radius <= 0.0) return std::vector<P>(); // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
+    }
+
+    inline std::vector<size_t> in_hypersphere_indices(P const& search, double radius) const
+    {
+        if (radius <= 0.0) return std::vector<size_t>(); // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::in_hypersphere(*this, root_cursor(), search, radius));
     }
 
     inline std::vector<P> in_box(P const& search, P const& sizes) const
     {
-        return lkd.in_box(search, sizes);
+        if (!Search::is_valid_box(sizes))
+            return std::vector<P>(); // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::points_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+    inline std::vector<size_t> in_box_indices(P const& search, P const& sizes) const
+    {
+        if (!Search::is_valid_box(sizes))
+            return std::vector<size_t>(); // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        return Search::indices_at(*this, Search::in_box(*this, root_cursor(), search, sizes));
+    }
+
+    // calls f(point) for every point within the sphere / box, without creating
+    // any container, f may return false to stop the search
+    template <typename F>
+    inline void for_each_in_hypersphere(P const& search, double radius, F&& f) const
+    {
+        if (radius <= 0.0) return; // no real search if radius <= 0
+
+        Scope scope(queryStats, totalStats);
+        Search::for_each_in_hypersphere(*this, root_cursor(), search, radius, f);
+    }
+
+    template <typename F>
+    inline void for_each_in_box(P const& search, P const& sizes, F&& f) const
+    {
+        if (!Search::is_valid_box(sizes))
+            return; // no real search if one dimension size is <= 0
+
+        Scope scope(queryStats, totalStats);
+        Search::for_each_in_box(*this, root_cursor(), search, sizes, f);
+    }
+
+    // write all points within the sphere / box to out
+    template <typename OutputIt>
+    inline OutputIt in_hypersphere(P const& search, double radius, OutputIt out) const
+    {
+        for_each_in_hypersphere(search, radius, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+    template <typename OutputIt>
+    inline OutputIt in_box(P const& search, P const& sizes, OutputIt out) const
+    {
+        for_each_in_box(search, sizes, [&out](P const& p) { *out++ = p; });
+        return out;
+    }
+
+    // the batch queries process all searches at once using threadCount threads,
+    // which is faster than querying them one by one
+    // results[i] is the result for searches[i]
+    // observed trees always use a single thread, counting a batch as one query
+    inline void nearest_batch(std::vector<P> const& searches, std::vector<P>& results, size_t threadCount = 1) const
+    {
+        throw_if_all_erased();
+        Scope scope(queryStats, totalStats);
+        Search::nearest_batch(*this, root_cursor(), searches, results, detail::observed_thread_count<Stats>(threadCount));
+    }
+
+    inline void k_nearest_batch(std::vector<P> const& searches, size_t n, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Scope scope(queryStats, totalStats);
+        Search::k_nearest_batch(*this, root_cursor(), searches, n, results, detail::observed_thread_count<Stats>(threadCount));
+    }
+
+    inline void in_hypersphere_batch(std::vector<P> const& searches, double radius, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Scope scope(queryStats, totalStats);
+        Search::in_hypersphere_batch(*this, root_cursor(), searches, radius, results, detail::observed_thread_count<Stats>(threadCount));
+    }
+
+    inline void in_box_batch(std::vector<P> const& searches, P const& sizes, std::vector<std::vector<P> >& results,
+        size_t threadCount = 1) const
+    {
+        Scope scope(queryStats, totalStats);
+        Search::in_box_batch(*this, root_cursor(), searches, sizes, results, detail::observed_thread_count<Stats>(threadCount));
+    }
+
+//------------------------------------------------------------------------------
+
+    // erases all points with the coordinates of p, returning their number
+    // the points are only marked as erased and skipped by queries, once a
+    // quarter of the points is erased, the tree is built anew without them
+    // erasing isn't thread-safe and invalidates the NearestIterators of the tree
+    size_t erase(P const& p)
+    {
+        static_assert(!std::is_same<Layout, Mapped>::value, "mapped trees are read-only");
+        Scope scope(queryStats, totalStats);
+
+        const auto positions = Search::in_hypersphere(*this, root_cursor(), p, 0.0);
+        for (const auto position : positions)
+            storage.erase(position);
+        nErased += positions.size();
+
+        compact_if_needed();
+        return positions.size();
+    }
+
+    // erases all points for which pred(point) returns true, returning their number
+    template <typename Pred>
+    size_t erase_if(Pred pred)
+    {
+        static_assert(!std::is_same<Layout, Mapped>::value, "mapped trees are read-only");
+
+        size_t n = 0;
+        for (size_t i = 0; i < storage.size(); ++i) {
+            if (!storage.is_erased(i) && pred(storage.point(i))) {
+                storage.erase(i);
+                ++n;
+            }
+        }
+        nErased += n;
+
+        compact_if_needed();
+        return n;
+    }
+
+//------------------------------------------------------------------------------
+
+    // writes the evaluated tree, which StrictKdTree(MappedFile&&) reads in
+    // place, so a saved tree is loaded without copying or evaluating anything
+    // P must be trivially copyable, its raw bytes are written, so the file can
+    // only be read on machines with the same byte order and layout of P
+    void save(std::ostream& out) const
+    {
+        detail::write_tree_file<P>(out, storage, detail::tree_file_header<P>(BucketSize, dim, storage.size(),
+            storage.size(), nErased, storage.next_index(), 0));
+    }
+
+    void save(std::string const& path) const
+    {
+        std::ofstream out(path.c_str(), std::ios::binary);
+        if (!out)
+            throw std::runtime_error("StrictKdTree can't write " + path);
+        save(out);
+    }
+
+//------------------------------------------------------------------------------
+
+    // the stats of the last query / summed over all queries since the last reset
+    inline Stats const& query_stats() const
+    {
+        return queryStats;
+    }
+
+    inline Stats const& total_stats() const
+    {
+        return totalStats;
+    }
+
+    inline void reset_stats()
+    {
+        queryStats = Stats();
+        totalStats = Stats();
     }
 
+    // the number of points which aren't erased
     inline size_t size() const
     {
-        return lkd.size();
+        return storage.size() - nErased;
     }
 };
 
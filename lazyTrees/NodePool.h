@@ -0,0 +1,119 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace lazyTrees {
+namespace detail {
+
+//------------------------------------------------------------------------------
+
+// monotonic arena for the nodes of a tree
+// nodes are value-initialized slots of blocks, creating one only bumps an
+// index, a new block being allocated once the last one is full
+// nodes are never destroyed one by one, all of them are released at once
+// by clear() or the destructor, therefore T must be trivially destructible
+// the blocks never move, so nodes stay at their addresses, even when the pool
+// is moved
+template <typename T>
+class NodePool {
+    static_assert(std::is_trivially_destructible<T>::value, "the nodes of a NodePool are never destroyed");
+
+private:
+    std::vector<std::unique_ptr<T[]> > blocks;
+
+    size_t nUsed;       // of the last block
+
+    size_t blockSize;   // of the last block
+
+    size_t nReserved;   // of all blocks
+
+public:
+    NodePool()
+        : blocks()
+        , nUsed(0)
+        , blockSize(0)
+        , nReserved(0)
+    {}
+
+    NodePool(NodePool&& other)
+        : blocks(std::move(other.blocks))
+        , nUsed(other.nUsed)
+        , blockSize(other.blockSize)
+        , nReserved(other.nReserved)
+    {
+        other.clear();
+    }
+
+    NodePool(NodePool const&) = delete;
+
+//------------------------------------------------------------------------------
+
+    // not thread-safe
+    inline T* create()
+    {
+        if (nUsed == blockSize)
+            grow();
+
+        return &blocks.back()[nUsed++];
+    }
+
+    void clear()
+    {
+        blocks.clear();
+        nUsed = 0;
+        blockSize = 0;
+        nReserved = 0;
+    }
+
+    inline size_t bytes() const
+    {
+        return nReserved * sizeof(T) + blocks.capacity() * sizeof(std::unique_ptr<T[]>);
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    // the blocks double in size, trees evaluated only a little stay small,
+    // while large ones need few blocks
+    static inline size_t min_block_size()
+    {
+        return 64;
+    }
+
+    static inline size_t max_block_size()
+    {
+        return 1 << 16;
+    }
+
+    void grow()
+    {
+        blockSize = std::min(std::max(2 * blockSize, min_block_size()), max_block_size());
+        blocks.push_back(std::unique_ptr<T[]>(new T[blockSize]()));
+        nUsed = 0;
+        nReserved += blockSize;
+    }
+};
+
+}
+}
+
+#endif // NODEPOOL_H
@@ -0,0 +1,756 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef POINTSTORAGE_H
+#define POINTSTORAGE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "PointTraits.h"
+#include "TreeFile.h"
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+// the layouts the trees can keep their points in
+
+// the points themselves are reordered, coordinates are read via P::operator[]
+struct AoS {};
+
+// the coordinates are copied into one contiguous array per dimension, which
+// is reordered instead of the points, so traversals never access P
+// requires (dimensions() + 1) * sizeof(Scalar) more memory per point
+struct SoA {};
+
+// the points of a saved StrictKdTree, read in place from the mapped file, so
+// loading neither copies nor parses them (see StrictKdTree::save())
+// trees of this layout are read-only
+struct Mapped {};
+
+// the points stay within a buffer owned by the caller (see PointView), only a
+// permutation of their offsets is reordered
+// requires sizeof(size_t) memory per point, but points can't be inserted
+struct View {};
+
+//------------------------------------------------------------------------------
+
+// a contiguous range of points owned by the caller, which trees of Layout View
+// index in place, without copying or moving any of them
+// the points must outlive the tree and must not change while it exists,
+// the indices of the tree are the offsets of the points within the range
+template <typename P>
+class PointView {
+private:
+    P const* first;
+    size_t count;
+
+public:
+    PointView(P const* points, size_t n)
+        : first(points)
+        , count(n)
+    {}
+
+    explicit PointView(std::vector<P> const& points)
+        : first(points.data())
+        , count(points.size())
+    {}
+
+    inline P const* data() const
+    {
+        return first;
+    }
+
+    inline size_t size() const
+    {
+        return count;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+namespace detail {
+
+// the fallback of nth_element_by, std::nth_element on a permutation of the
+// positions [begin, end), which is applied by swaps afterwards
+// requires memory for three indices per position
+template <typename Key, typename Swap>
+void nth_element_by_permutation(size_t begin, size_t nth, size_t end, Key const& key, Swap const& swap)
+{
+    const size_t n = end - begin;
+
+    // order[k] is the element which belongs to begin + k, at[k] the element
+    // now at begin + k, where[o] the position of the element which was at
+    // begin + o
+    std::vector<size_t> order(n), at(n), where(n);
+    for (size_t k = 0; k < n; ++k)
+        order[k] = at[k] = where[k] = k;
+
+    std::nth_element(order.begin(), order.begin() + (nth - begin), order.end(),
+        [&key, begin](size_t a, size_t b) { return key(begin + a) < key(begin + b); });
+
+    for (size_t k = 0; k < n; ++k) {
+        const size_t o = order[k], p = where[o];
+        if (p == k)
+            continue;
+        swap(begin + k, begin + p);
+        where[at[k]] = p;
+        at[p] = at[k];
+        at[k] = o;
+        where[o] = k;
+    }
+}
+
+// std::nth_element on the positions [begin, end), but all elements are accessed
+// via key(position) and swap(position, position), so several buffers can be
+// kept in the same order
+// a quickselect, falling back to nth_element_by_permutation once the
+// partitions fail to shrink the range, so inputs degrading the median of
+// three pivots don't take quadratic time (introselect)
+template <typename Key, typename Swap>
+void nth_element_by(size_t begin, size_t nth, size_t end, Key const& key, Swap const& swap)
+{
+    size_t depthLimit = 0;
+    for (size_t n = end - begin; n > 1; n /= 2)
+        depthLimit += 2;
+
+    while (end - begin > 16) {
+        if (depthLimit-- == 0) {
+            nth_element_by_permutation(begin, nth, end, key, swap);
+            return;
+        }
+
+        // median of three as pivot, which also serves as sentinel for the scans
+        const size_t middle = begin + (end - begin) / 2;
+        if (key(middle) < key(begin))   swap(middle, begin);
+        if (key(end - 1) < key(begin))  swap(end - 1, begin);
+        if (key(end - 1) < key(middle)) swap(end - 1, middle);
+        const auto pivot = key(middle);
+
+        // Hoare partition, [begin, j] <= pivot <= [j + 1, end)
+        size_t i = begin, j = end - 1;
+        while (true) {
+            while (key(i) < pivot) ++i;
+            while (pivot < key(j)) --j;
+            if (i >= j)
+                break;
+            swap(i, j);
+            ++i;
+            --j;
+        }
+
+        if (nth <= j)
+            end = j + 1;
+        else
+            begin = j + 1;
+    }
+
+    // insertion sort for the remaining few elements
+    for (size_t i = begin + 1; i < end; ++i) {
+        for (size_t j = i; j > begin && key(j) < key(j - 1); --j)
+            swap(j, j - 1);
+    }
+}
+
+// the identity permutation for n points, as initial indices of a tree
+inline std::vector<size_t> identity(size_t n)
+{
+    std::vector<size_t> res(n);
+    for (size_t i = 0; i < n; ++i)
+        res[i] = i;
+    return res;
+}
+
+//------------------------------------------------------------------------------
+
+// the buffer of a tree, addressed by positions
+// partition(begin, nth, end, dim) places the point with the nth smallest
+// coordinate in dim at nth, with all smaller ones before and all larger ones
+// after it, returning the number of points moved
+// append(p) adds p at the end, its index being the number of points added before
+// erase(position) marks the point at position as erased (a tombstone), which
+// is kept at the point while partitioning, compact() removes all erased points
+// keeping the order and the indices of the others
+// a storage can also be created from points already in the order of their
+// positions, as saved by the trees
+// the Mapped storage only offers the read access, the View storage can't append
+template <typename P, typename Layout>
+class Storage;
+
+template <typename P>
+class Storage<P, AoS> {
+public:
+    typedef typename PointTraits<P>::Scalar Scalar;
+
+private:
+    std::vector<P> points;
+
+    // indices[i] is the index points[i] had within the input
+    // created on the first partition, until then points are in input order
+    std::vector<size_t> indices;
+
+    std::vector<bool> erased; // by position, empty if nothing is erased
+
+    size_t nextIndex;
+
+public:
+    explicit Storage(std::vector<P>&& in)
+        : points(std::move(in))
+        , indices()
+        , erased()
+        , nextIndex(points.size())
+    {}
+
+    explicit Storage(std::vector<P> const& in)
+        : points(in)
+        , indices()
+        , erased()
+        , nextIndex(points.size())
+    {}
+
+    Storage(std::vector<P>&& in, std::vector<size_t>&& inIndices, std::vector<bool>&& inErased, size_t inNextIndex)
+        : points(std::move(in))
+        , indices(std::move(inIndices))
+        , erased(std::move(inErased))
+        , nextIndex(inNextIndex)
+    {}
+
+    inline size_t size() const
+    {
+        return points.size();
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return points[position];
+    }
+
+    inline Scalar coordinate(size_t position, size_t dim) const
+    {
+        return points[position][dim];
+    }
+
+    // the coordinates of dim as contiguous array, if stored that way
+    inline Scalar const* coordinates(size_t) const
+    {
+        return nullptr;
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return indices.empty() ? position : indices[position];
+    }
+
+    inline bool is_erased(size_t position) const
+    {
+        return !erased.empty() && erased[position];
+    }
+
+    // the index of the next appended point
+    inline size_t next_index() const
+    {
+        return nextIndex;
+    }
+
+    inline void append(P const& p)
+    {
+        if (!indices.empty())
+            indices.push_back(nextIndex);
+        if (!erased.empty())
+            erased.push_back(false);
+        points.push_back(p);
+        ++nextIndex;
+    }
+
+    inline void erase(size_t position)
+    {
+        if (erased.empty())
+            erased.resize(points.size(), false);
+        erased[position] = true;
+    }
+
+    void compact()
+    {
+        if (erased.empty())
+            return;
+
+        if (indices.empty())
+            indices = identity(points.size());
+
+        size_t n = 0;
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (erased[i])
+                continue;
+            if (n != i) {
+                points[n] = std::move(points[i]);
+                indices[n] = indices[i];
+            }
+            ++n;
+        }
+
+        points.erase(points.begin() + n, points.end());
+        indices.erase(indices.begin() + n, indices.end());
+        points.shrink_to_fit();
+        indices.shrink_to_fit();
+        std::vector<bool>().swap(erased);
+    }
+
+    // moves the points which aren't erased to the end of out, leaving the
+    // storage empty
+    void release(std::vector<P>& out)
+    {
+        out.reserve(out.size() + points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (!is_erased(i))
+                out.push_back(std::move(points[i]));
+        }
+
+        std::vector<P>().swap(points);
+        std::vector<size_t>().swap(indices);
+        std::vector<bool>().swap(erased);
+    }
+
+    size_t partition(size_t begin, size_t nth, size_t end, size_t dim)
+    {
+        if (indices.empty())
+            indices = identity(points.size());
+
+        const bool hasErased = !erased.empty();
+        size_t nSwaps = 0;
+        nth_element_by(begin, nth, end,
+            [this, dim](size_t i) { return points[i][dim]; },
+            [this, hasErased, &nSwaps](size_t i, size_t j) {
+                std::swap(points[i], points[j]);
+                std::swap(indices[i], indices[j]);
+                if (hasErased)
+                    std::vector<bool>::swap(erased[i], erased[j]);
+                ++nSwaps;
+            });
+        return 2 * nSwaps;
+    }
+
+    // the memory required per point, once partitioned
+    static inline size_t bytes_per_point()
+    {
+        return sizeof(P) + sizeof(size_t);
+    }
+
+    inline size_t bytes() const
+    {
+        return points.capacity() * sizeof(P) + indices.capacity() * sizeof(size_t) + erased.capacity() / 8;
+    }
+};
+
+template <typename P>
+class Storage<P, SoA> {
+public:
+    typedef typename PointTraits<P>::Scalar Scalar;
+
+private:
+    std::vector<P> points; // in input order, until compacted
+
+    std::vector<size_t> indices; // indices[i] is the slot within points of the point at position i
+
+    std::vector<size_t> ids; // ids[slot] is the index of the point in slot, empty until compacted
+
+    std::vector<Scalar> coords; // coords[dim * stride + i] is coordinate dim of position i
+
+    size_t stride; // the capacity per dimension, >= size()
+
+    std::vector<bool> erased; // by position, empty if nothing is erased
+
+    size_t nextIndex;
+
+public:
+    explicit Storage(std::vector<P>&& in)
+        : points(std::move(in))
+        , indices()
+        , ids()
+        , coords()
+        , stride(0)
+        , erased()
+        , nextIndex(points.size())
+    {
+        init();
+    }
+
+    explicit Storage(std::vector<P> const& in)
+        : points(in)
+        , indices()
+        , ids()
+        , coords()
+        , stride(0)
+        , erased()
+        , nextIndex(points.size())
+    {
+        init();
+    }
+
+    // the points are kept in the order of their positions, as if compacted
+    Storage(std::vector<P>&& in, std::vector<size_t>&& inIndices, std::vector<bool>&& inErased, size_t inNextIndex)
+        : points(std::move(in))
+        , indices()
+        , ids(std::move(inIndices))
+        , coords()
+        , stride(0)
+        , erased(std::move(inErased))
+        , nextIndex(inNextIndex)
+    {
+        init();
+    }
+
+    inline size_t size() const
+    {
+        return points.size();
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return points[indices[position]];
+    }
+
+    inline Scalar coordinate(size_t position, size_t dim) const
+    {
+        return coords[dim * stride + position];
+    }
+
+    inline Scalar const* coordinates(size_t dim) const
+    {
+        return coords.data() + dim * stride;
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return ids.empty() ? indices[position] : ids[indices[position]];
+    }
+
+    inline bool is_erased(size_t position) const
+    {
+        return !erased.empty() && erased[position];
+    }
+
+    // the index of the next appended point
+    inline size_t next_index() const
+    {
+        return nextIndex;
+    }
+
+    // the coordinates are copied to arrays of twice the size once full
+    void append(P const& p)
+    {
+        const size_t n = points.size();
+        const size_t nDims = PointTraits<P>::dimensions();
+
+        if (n == stride)
+            reserve(std::max<size_t>(2 * stride, 16));
+
+        for (size_t d = 0; d < nDims; ++d)
+            coords[d * stride + n] = p[d];
+        indices.push_back(n);
+        if (!ids.empty())
+            ids.push_back(nextIndex);
+        if (!erased.empty())
+            erased.push_back(false);
+        points.push_back(p);
+        ++nextIndex;
+    }
+
+    inline void erase(size_t position)
+    {
+        if (erased.empty())
+            erased.resize(points.size(), false);
+        erased[position] = true;
+    }
+
+    // the remaining points are stored in the order of their positions
+    void compact()
+    {
+        if (erased.empty())
+            return;
+
+        const size_t nDims = PointTraits<P>::dimensions();
+
+        std::vector<P> newPoints;
+        std::vector<size_t> newIds;
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (erased[i])
+                continue;
+            newPoints.push_back(std::move(points[indices[i]]));
+            newIds.push_back(index(i));
+        }
+
+        const size_t n = newPoints.size();
+        std::vector<Scalar> newCoords(nDims * n);
+        for (size_t d = 0; d < nDims; ++d) {
+            size_t j = 0;
+            for (size_t i = 0; i < points.size(); ++i) {
+                if (!erased[i])
+                    newCoords[d * n + j++] = coords[d * stride + i];
+            }
+        }
+
+        points.swap(newPoints);
+        ids.swap(newIds);
+        coords.swap(newCoords);
+        indices = identity(n);
+        stride = n;
+        std::vector<bool>().swap(erased);
+    }
+
+    size_t partition(size_t begin, size_t nth, size_t end, size_t dim)
+    {
+        const size_t n = stride;
+        const size_t nDims = PointTraits<P>::dimensions();
+        Scalar const* key = coordinates(dim);
+
+        const bool hasErased = !erased.empty();
+        size_t nSwaps = 0;
+        nth_element_by(begin, nth, end,
+            [key](size_t i) { return key[i]; },
+            [this, n, nDims, hasErased, &nSwaps](size_t i, size_t j) {
+                for (size_t d = 0; d < nDims; ++d)
+                    std::swap(coords[d * n + i], coords[d * n + j]);
+                std::swap(indices[i], indices[j]);
+                if (hasErased)
+                    std::vector<bool>::swap(erased[i], erased[j]);
+                ++nSwaps;
+            });
+        return 2 * nSwaps;
+    }
+
+    static inline size_t bytes_per_point()
+    {
+        return sizeof(P) + sizeof(size_t) + PointTraits<P>::dimensions() * sizeof(Scalar);
+    }
+
+    inline size_t bytes() const
+    {
+        return points.capacity() * sizeof(P)
+             + indices.capacity() * sizeof(size_t)
+             + ids.capacity() * sizeof(size_t)
+             + coords.capacity() * sizeof(Scalar)
+             + erased.capacity() / 8;
+    }
+
+private:
+    void init()
+    {
+        const size_t n = points.size();
+        const size_t nDims = PointTraits<P>::dimensions();
+
+        indices = identity(n);
+        stride = n;
+        coords.resize(nDims * n);
+        for (size_t d = 0; d < nDims; ++d) {
+            for (size_t i = 0; i < n; ++i)
+                coords[d * n + i] = points[i][d];
+        }
+    }
+
+    void reserve(size_t newStride)
+    {
+        const size_t nDims = PointTraits<P>::dimensions();
+
+        std::vector<Scalar> newCoords(nDims * newStride);
+        for (size_t d = 0; d < nDims; ++d)
+            std::copy(coords.begin() + d * stride, coords.begin() + d * stride + points.size(), newCoords.begin() + d * newStride);
+
+        coords.swap(newCoords);
+        stride = newStride;
+    }
+};
+
+template <typename P>
+class Storage<P, Mapped> {
+public:
+    typedef typename PointTraits<P>::Scalar Scalar;
+
+private:
+    MappedFile file;
+
+    TreeFileHeader const* header;
+
+    P const* points; // by position
+
+    size_t const* indices; // by position
+
+    unsigned char const* erased; // by position, nullptr if nothing is erased
+
+public:
+    explicit Storage(MappedFile&& in)
+        : file(std::move(in))
+        , header(&read_tree_file_header<P>(file))
+        , points(reinterpret_cast<P const*>(file.data() + header->pointsOffset))
+        , indices(reinterpret_cast<size_t const*>(file.data() + header->indicesOffset))
+        , erased(header->erasedOffset ? reinterpret_cast<unsigned char const*>(file.data() + header->erasedOffset) : nullptr)
+    {}
+
+    inline TreeFileHeader const& file_header() const
+    {
+        return *header;
+    }
+
+    inline size_t size() const
+    {
+        return header->size;
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return points[position];
+    }
+
+    inline Scalar coordinate(size_t position, size_t dim) const
+    {
+        return points[position][dim];
+    }
+
+    inline Scalar const* coordinates(size_t) const
+    {
+        return nullptr;
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return indices[position];
+    }
+
+    inline bool is_erased(size_t position) const
+    {
+        return erased && erased[position];
+    }
+
+    inline size_t next_index() const
+    {
+        return header->nextIndex;
+    }
+};
+
+
+template <typename P>
+class Storage<P, View> {
+public:
+    typedef typename PointTraits<P>::Scalar Scalar;
+
+private:
+    PointView<P> points;
+
+    std::vector<size_t> indices; // indices[i] is the offset within points of the point at position i
+
+    std::vector<bool> erased; // by position, empty if nothing is erased
+
+public:
+    explicit Storage(PointView<P> in)
+        : points(in)
+        , indices(identity(in.size()))
+        , erased()
+    {}
+
+    inline size_t size() const
+    {
+        return indices.size();
+    }
+
+    inline P const& point(size_t position) const
+    {
+        return points.data()[indices[position]];
+    }
+
+    inline Scalar coordinate(size_t position, size_t dim) const
+    {
+        return points.data()[indices[position]][dim];
+    }
+
+    inline Scalar const* coordinates(size_t) const
+    {
+        return nullptr;
+    }
+
+    inline size_t index(size_t position) const
+    {
+        return indices[position];
+    }
+
+    inline bool is_erased(size_t position) const
+    {
+        return !erased.empty() && erased[position];
+    }
+
+    // no points can be appended to the view
+    inline size_t next_index() const
+    {
+        return points.size();
+    }
+
+    inline void erase(size_t position)
+    {
+        if (erased.empty())
+            erased.resize(indices.size(), false);
+        erased[position] = true;
+    }
+
+    // only the offsets of the erased points are removed, the view is untouched
+    void compact()
+    {
+        if (erased.empty())
+            return;
+
+        size_t n = 0;
+        for (size_t i = 0; i < indices.size(); ++i) {
+            if (!erased[i])
+                indices[n++] = indices[i];
+        }
+
+        indices.erase(indices.begin() + n, indices.end());
+        indices.shrink_to_fit();
+        std::vector<bool>().swap(erased);
+    }
+
+    size_t partition(size_t begin, size_t nth, size_t end, size_t dim)
+    {
+        P const* data = points.data();
+
+        const bool hasErased = !erased.empty();
+        size_t nSwaps = 0;
+        nth_element_by(begin, nth, end,
+            [this, data, dim](size_t i) { return data[indices[i]][dim]; },
+            [this, hasErased, &nSwaps](size_t i, size_t j) {
+                std::swap(indices[i], indices[j]);
+                if (hasErased)
+                    std::vector<bool>::swap(erased[i], erased[j]);
+                ++nSwaps;
+            });
+        return 2 * nSwaps;
+    }
+
+    // the points themselves belong to the caller
+    static inline size_t bytes_per_point()
+    {
+        return sizeof(size_t);
+    }
+
+    inline size_t bytes() const
+    {
+        return indices.capacity() * sizeof(size_t) + erased.capacity() / 8;
+    }
+};
+
+}
+
+}
+
+#endif // POINTSTORAGE_H
@@ -0,0 +1,61 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef POINTTRAITS_H
+#define POINTTRAITS_H
+
+#include <cstddef>
+#include <type_traits>
+#include <utility>
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+namespace detail {
+
+// P::dimensions() if it is constexpr, 0 otherwise
+template <typename P, typename = void>
+struct StaticDimensions : std::integral_constant<size_t, 0> {};
+
+template <typename P>
+struct StaticDimensions<P, typename std::enable_if<(P::dimensions() > 0)>::type>
+    : std::integral_constant<size_t, P::dimensions()> {};
+
+}
+
+//------------------------------------------------------------------------------
+
+// how the trees access the coordinates of P
+// may be specialized for point types which can't be detected automatically,
+// e.g. to define the number of dimensions at compile time
+template <typename P>
+struct PointTraits {
+    // the coordinate type, e.g. double, float or int
+    typedef typename std::decay<decltype(std::declval<P const&>()[0])>::type Scalar;
+
+    // the type distances are computed with, float coordinates stay float
+    typedef typename std::conditional<std::is_same<Scalar, float>::value, float, double>::type Distance;
+
+    // the number of dimensions if known at compile time, 0 otherwise
+    static const size_t StaticDimensions = detail::StaticDimensions<P>::value;
+
+    static inline size_t dimensions()
+    {
+        return StaticDimensions > 0 ? size_t(StaticDimensions) : P::dimensions();
+    }
+};
+
+}
+
+#endif // POINTTRAITS_H
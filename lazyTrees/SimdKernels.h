@@ -0,0 +1,200 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef SIMDKERNELS_H
+#define SIMDKERNELS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+#if defined(__AVX512F__) || defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace lazyTrees {
+namespace detail {
+
+//------------------------------------------------------------------------------
+
+// the leaf buckets are scanned in blocks of this many points
+static const size_t SimdBlockSize = 16;
+
+// the lanes of the widest instruction set enabled at compile time
+// (e.g. via -march=native), the scalar version is the fallback
+// Lanes<T>::width values of T are processed per instruction
+template <typename T>
+struct Lanes {
+    typedef T V;
+    static const size_t width = 1;
+
+    static inline V load(T const* p)          { return *p; }
+    static inline void store(T* p, V v)       { *p = v; }
+    static inline V set(T x)                  { return x; }
+    static inline V sub(V a, V b)             { return a - b; }
+    static inline V mul(V a, V b)             { return a * b; }
+    static inline V add(V a, V b)             { return a + b; }
+    static inline V max(V a, V b)             { return a < b ? b : a; }
+    static inline V abs(V a)                  { return std::fabs(a); }
+};
+
+#if defined(__AVX512F__)
+
+// max selects by a compare mask like the scalar version, _mm512_max_pd/ps
+// inlined into the kernels make GCC 12 warn with -Wmaybe-uninitialized
+template <>
+struct Lanes<double> {
+    typedef __m512d V;
+    static const size_t width = 8;
+
+    static inline V load(double const* p)     { return _mm512_loadu_pd(p); }
+    static inline void store(double* p, V v)  { _mm512_storeu_pd(p, v); }
+    static inline V set(double x)             { return _mm512_set1_pd(x); }
+    static inline V sub(V a, V b)             { return _mm512_sub_pd(a, b); }
+    static inline V mul(V a, V b)             { return _mm512_mul_pd(a, b); }
+    static inline V add(V a, V b)             { return _mm512_add_pd(a, b); }
+    static inline V max(V a, V b)             { return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a, b, _CMP_LT_OQ), a, b); }
+    static inline V abs(V a)                  { return _mm512_abs_pd(a); }
+};
+
+template <>
+struct Lanes<float> {
+    typedef __m512 V;
+    static const size_t width = 16;
+
+    static inline V load(float const* p)      { return _mm512_loadu_ps(p); }
+    static inline void store(float* p, V v)   { _mm512_storeu_ps(p, v); }
+    static inline V set(float x)              { return _mm512_set1_ps(x); }
+    static inline V sub(V a, V b)             { return _mm512_sub_ps(a, b); }
+    static inline V mul(V a, V b)             { return _mm512_mul_ps(a, b); }
+    static inline V add(V a, V b)             { return _mm512_add_ps(a, b); }
+    static inline V max(V a, V b)             { return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(a, b, _CMP_LT_OQ), a, b); }
+    static inline V abs(V a)                  { return _mm512_abs_ps(a); }
+};
+
+#elif defined(__AVX__)
+
+template <>
+struct Lanes<double> {
+    typedef __m256d V;
+    static const size_t width = 4;
+
+    static inline V load(double const* p)     { return _mm256_loadu_pd(p); }
+    static inline void store(double* p, V v)  { _mm256_storeu_pd(p, v); }
+    static inline V set(double x)             { return _mm256_set1_pd(x); }
+    static inline V sub(V a, V b)             { return _mm256_sub_pd(a, b); }
+    static inline V mul(V a, V b)             { return _mm256_mul_pd(a, b); }
+    static inline V add(V a, V b)             { return _mm256_add_pd(a, b); }
+    static inline V max(V a, V b)             { return _mm256_max_pd(a, b); }
+    static inline V abs(V a)                  { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+};
+
+template <>
+struct Lanes<float> {
+    typedef __m256 V;
+    static const size_t width = 8;
+
+    static inline V load(float const* p)      { return _mm256_loadu_ps(p); }
+    static inline void store(float* p, V v)   { _mm256_storeu_ps(p, v); }
+    static inline V set(float x)              { return _mm256_set1_ps(x); }
+    static inline V sub(V a, V b)             { return _mm256_sub_ps(a, b); }
+    static inline V mul(V a, V b)             { return _mm256_mul_ps(a, b); }
+    static inline V add(V a, V b)             { return _mm256_add_ps(a, b); }
+    static inline V max(V a, V b)             { return _mm256_max_ps(a, b); }
+    static inline V abs(V a)                  { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+};
+
+#elif defined(__SSE2__)
+
+template <>
+struct Lanes<double> {
+    typedef __m128d V;
+    static const size_t width = 2;
+
+    static inline V load(double const* p)     { return _mm_loadu_pd(p); }
+    static inline void store(double* p, V v)  { _mm_storeu_pd(p, v); }
+    static inline V set(double x)             { return _mm_set1_pd(x); }
+    static inline V sub(V a, V b)             { return _mm_sub_pd(a, b); }
+    static inline V mul(V a, V b)             { return _mm_mul_pd(a, b); }
+    static inline V add(V a, V b)             { return _mm_add_pd(a, b); }
+    static inline V max(V a, V b)             { return _mm_max_pd(a, b); }
+    static inline V abs(V a)                  { return _mm_andnot_pd(_mm_set1_pd(-0.0), a); }
+};
+
+template <>
+struct Lanes<float> {
+    typedef __m128 V;
+    static const size_t width = 4;
+
+    static inline V load(float const* p)      { return _mm_loadu_ps(p); }
+    static inline void store(float* p, V v)   { _mm_storeu_ps(p, v); }
+    static inline V set(float x)              { return _mm_set1_ps(x); }
+    static inline V sub(V a, V b)             { return _mm_sub_ps(a, b); }
+    static inline V mul(V a, V b)             { return _mm_mul_ps(a, b); }
+    static inline V add(V a, V b)             { return _mm_add_ps(a, b); }
+    static inline V max(V a, V b)             { return _mm_max_ps(a, b); }
+    static inline V abs(V a)                  { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+};
+
+#endif
+
+//------------------------------------------------------------------------------
+
+// the kernels process one dimension of a block of n <= SimdBlockSize points
+// coords[i] being the coordinate of the i-th point of the block
+// the points not filling a whole vector are processed one by one, so no
+// lanes beyond n are read or written
+// they use the same operations in the same order as the scalar distance
+// computations, so both yield identical results
+
+// sqrDists[i] += (search - coords[i])^2
+template <typename T>
+inline void add_square_diffs(T* sqrDists, T const* coords, T search, size_t n)
+{
+    typedef Lanes<T> L;
+    const typename L::V s = L::set(search);
+
+    size_t i = 0;
+    for (; i + L::width <= n; i += L::width) {
+        const typename L::V diff = L::sub(s, L::load(coords + i));
+        L::store(sqrDists + i, L::add(L::load(sqrDists + i), L::mul(diff, diff)));
+    }
+    for (; i < n; ++i) {
+        const T diff = search - coords[i];
+        sqrDists[i] += diff * diff;
+    }
+}
+
+// excess[i] = max(excess[i], |search - coords[i]| - halfSize)
+// a point is within the box if its excess over all dimensions is <= 0
+template <typename T>
+inline void max_box_excess(T* excess, T const* coords, T search, T halfSize, size_t n)
+{
+    typedef Lanes<T> L;
+    const typename L::V s = L::set(search);
+    const typename L::V h = L::set(halfSize);
+
+    size_t i = 0;
+    for (; i + L::width <= n; i += L::width) {
+        const typename L::V dist = L::abs(L::sub(s, L::load(coords + i)));
+        L::store(excess + i, L::max(L::load(excess + i), L::sub(dist, h)));
+    }
+    for (; i < n; ++i)
+        excess[i] = std::max(excess[i], T(std::fabs(search - coords[i])) - halfSize);
+}
+
+}
+}
+
+#endif // SIMDKERNELS_H
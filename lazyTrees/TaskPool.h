@@ -0,0 +1,153 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lazyTrees {
+namespace detail {
+
+//------------------------------------------------------------------------------
+
+// minimal work-stealing pool for fork-join style tasks
+// every worker has its own queue, spawning pushes to the back of the own queue
+// and workers take from the back of their own queue first (depth first)
+// idle workers steal from the front of other queues, which are the largest
+// remaining tasks when splitting recursively
+class TaskPool {
+public:
+    typedef std::function<void(TaskPool&, size_t worker)> Task;
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    const size_t nWorkers;
+
+    std::unique_ptr<Queue[]> queues;
+
+    std::atomic<size_t> nPending; // spawned, but not yet finished tasks
+
+    std::mutex errorMutex;
+
+    std::exception_ptr error;
+
+//------------------------------------------------------------------------------
+
+    explicit TaskPool(size_t nThreads)
+        : nWorkers(nThreads > 0 ? nThreads : 1)
+        , queues(new Queue[nWorkers])
+        , nPending(0)
+        , error(nullptr)
+    {}
+
+public:
+    TaskPool(TaskPool const&) = delete;
+
+    // runs task and all tasks spawned by it on nThreads threads, the calling
+    // thread being one of them, and returns once all of them have finished
+    // the first exception thrown by any task is rethrown
+    static void run(size_t nThreads, Task task)
+    {
+        TaskPool pool(nThreads);
+        pool.spawn(0, std::move(task));
+
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < pool.nWorkers; ++i)
+            threads.push_back(std::thread([&pool, i]() { pool.work(i); }));
+
+        pool.work(0);
+
+        for (auto& thread : threads)
+            thread.join();
+
+        if (pool.error)
+            std::rethrow_exception(pool.error);
+    }
+
+    // may only be called from within a task, passing the worker running it
+    void spawn(size_t worker, Task task)
+    {
+        ++nPending;
+        Queue& queue = queues[worker];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+
+//------------------------------------------------------------------------------
+//------------------------------------------------------------------------------
+
+private:
+    void work(size_t worker)
+    {
+        Task task;
+        while (nPending > 0) {
+            if (!take(worker, task)) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            try {
+                task(*this, worker);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!error)
+                    error = std::current_exception();
+            }
+
+            task = nullptr;
+            --nPending;
+        }
+    }
+
+    bool take(size_t worker, Task& task)
+    {
+        {
+            Queue& own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < nWorkers; ++i) {
+            Queue& other = queues[(worker + i) % nWorkers];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+}
+}
+
+#endif // TASKPOOL_H
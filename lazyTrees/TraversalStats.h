@@ -0,0 +1,115 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TRAVERSALSTATS_H
+#define TRAVERSALSTATS_H
+
+#include <cstddef>
+#include <type_traits>
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+// the Stats parameter of the trees observes the traversals of all queries
+// an observer offers the hooks of NoStats and has to be default constructible,
+// copyable and summable via +=
+
+// the default, all hooks are empty and vanish when inlined
+struct NoStats {
+    inline void node_visited() {}
+    inline void node_pruned() {}
+    inline void distance_computed() {}
+    inline void node_evaluated() {}
+    inline void points_moved(size_t) {}
+
+    inline NoStats& operator+=(NoStats const&)
+    {
+        return *this;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+// counts the work done by queries
+struct TraversalStats {
+    size_t nodesVisited;         // subtrees entered, leaf buckets included
+    size_t nodesPruned;          // subtrees skipped because they can't contain results
+    size_t distanceComputations; // distances / box tests computed to points
+    size_t nodesEvaluated;       // subtrees partitioned by the query (lazy trees only)
+    size_t pointsMoved;          // points swapped while partitioning
+
+    TraversalStats()
+        : nodesVisited(0)
+        , nodesPruned(0)
+        , distanceComputations(0)
+        , nodesEvaluated(0)
+        , pointsMoved(0)
+    {}
+
+    inline void node_visited()         { ++nodesVisited; }
+    inline void node_pruned()          { ++nodesPruned; }
+    inline void distance_computed()    { ++distanceComputations; }
+    inline void node_evaluated()       { ++nodesEvaluated; }
+    inline void points_moved(size_t n) { pointsMoved += n; }
+
+    inline TraversalStats& operator+=(TraversalStats const& other)
+    {
+        nodesVisited         += other.nodesVisited;
+        nodesPruned          += other.nodesPruned;
+        distanceComputations += other.distanceComputations;
+        nodesEvaluated       += other.nodesEvaluated;
+        pointsMoved          += other.pointsMoved;
+        return *this;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+namespace detail {
+
+// the stats of a single query, added to the total ones once the query is done
+template <typename Stats>
+class QueryScope {
+private:
+    Stats& query;
+    Stats& total;
+
+public:
+    QueryScope(Stats& query, Stats& total)
+        : query(query)
+        , total(total)
+    {
+        query = Stats();
+    }
+
+    QueryScope(QueryScope const&) = delete;
+
+    ~QueryScope()
+    {
+        total += query;
+    }
+};
+
+// observers aren't synchronized, so observed trees always run single threaded
+template <typename Stats>
+inline size_t observed_thread_count(size_t nThreads)
+{
+    return std::is_same<Stats, NoStats>::value ? nThreads : 1;
+}
+
+}
+
+}
+
+#endif // TRAVERSALSTATS_H
@@ -0,0 +1,343 @@
+/*
+    Copyright (c) 2016 Martin Buck
+    Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"),
+    to deal in the Software without restriction, including without limitation the rights to
+    use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software,
+    and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+    The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+    DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE
+    OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+#ifndef TREEFILE_H
+#define TREEFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "PointTraits.h"
+
+namespace lazyTrees {
+
+//------------------------------------------------------------------------------
+
+// a file mapped read-only into memory, the pages are shared with all other
+// processes mapping the same file and loaded on first access
+class MappedFile {
+private:
+    char const* begin;
+    size_t length;
+
+public:
+    explicit MappedFile(std::string const& path)
+        : begin(nullptr)
+        , length(0)
+    {
+#if defined(_WIN32)
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("MappedFile can't open " + path);
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            CloseHandle(file);
+            throw std::runtime_error("MappedFile can't determine the size of " + path);
+        }
+        length = static_cast<size_t>(fileSize.QuadPart);
+
+        if (length > 0) {
+            // the view keeps the mapping alive, so both handles can be closed
+            HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (mapping)
+                CloseHandle(mapping);
+            CloseHandle(file);
+            if (!view)
+                throw std::runtime_error("MappedFile can't map " + path);
+            begin = static_cast<char const*>(view);
+        } else {
+            CloseHandle(file);
+        }
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("MappedFile can't open " + path);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("MappedFile can't determine the size of " + path);
+        }
+        length = static_cast<size_t>(st.st_size);
+
+        if (length > 0) {
+            // the mapping stays valid after closing the file
+            void* view = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (view == MAP_FAILED)
+                throw std::runtime_error("MappedFile can't map " + path);
+            begin = static_cast<char const*>(view);
+        } else {
+            ::close(fd);
+        }
+#endif
+    }
+
+    // the mapping doesn't move, pointers into it stay valid
+    MappedFile(MappedFile&& other)
+        : begin(other.begin)
+        , length(other.length)
+    {
+        other.begin = nullptr;
+        other.length = 0;
+    }
+
+    MappedFile(MappedFile const&) = delete;
+
+    ~MappedFile()
+    {
+        if (!begin)
+            return;
+#if defined(_WIN32)
+        UnmapViewOfFile(begin);
+#else
+        ::munmap(const_cast<char*>(begin), length);
+#endif
+    }
+
+    inline char const* data() const
+    {
+        return begin;
+    }
+
+    inline size_t size() const
+    {
+        return length;
+    }
+};
+
+//------------------------------------------------------------------------------
+
+namespace detail {
+
+// the file of a saved tree starts with this header, followed by the points
+// in the order of their positions, their indices and, if any point is
+// erased, one byte per point marking the erased ones
+// partially evaluated trees add one byte per subtree which isn't a leaf
+// bucket, in preorder, marking the evaluated ones, children of unevaluated
+// subtrees aren't listed, fully evaluated trees omit this section
+// each section starts at a multiple of tree_file_alignment(), so it can be
+// accessed in place once the file is mapped
+// the raw bytes of the points are stored, therefore files can only be read on
+// machines with the same byte order and the same layout of P
+struct TreeFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;     // tree_file_byte_order() as written by the machine saving the tree
+    uint32_t pointBytes;    // sizeof(P)
+    uint32_t indexBytes;    // sizeof(size_t)
+    uint32_t dimensions;
+    uint32_t padding;
+    uint64_t bucketSize;    // the BucketSize the tree was evaluated with
+    uint64_t dim;           // the dimension the root is split in
+    uint64_t size;          // the number of points, including the erased ones
+    uint64_t nPlaced;       // the tree covers the first nPlaced points, the inserted ones after them aren't placed yet
+    uint64_t nErased;
+    uint64_t nextIndex;     // the index of the next inserted point
+    uint64_t pointsOffset;
+    uint64_t indicesOffset;
+    uint64_t erasedOffset;  // 0 if nothing is erased
+    uint64_t nodesOffset;   // 0 if fully evaluated
+    uint64_t nodesBytes;
+    uint64_t fileBytes;
+
+    inline bool is_fully_evaluated() const
+    {
+        return nodesBytes == 0 && nPlaced == size;
+    }
+};
+
+inline char const* tree_file_magic()
+{
+    return "LAZYKDT";
+}
+
+inline uint32_t tree_file_version()
+{
+    return 2;
+}
+
+inline uint32_t tree_file_byte_order()
+{
+    return 0x01020304;
+}
+
+inline uint64_t tree_file_alignment()
+{
+    return 64;
+}
+
+inline uint64_t tree_file_aligned(uint64_t offset)
+{
+    return (offset + tree_file_alignment() - 1) / tree_file_alignment() * tree_file_alignment();
+}
+
+template <typename P>
+TreeFileHeader tree_file_header(size_t bucketSize, size_t dim, size_t size, size_t nPlaced, size_t nErased,
+    size_t nextIndex, size_t nodesBytes)
+{
+    TreeFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, tree_file_magic(), sizeof(header.magic));
+    header.version = tree_file_version();
+    header.byteOrder = tree_file_byte_order();
+    header.pointBytes = sizeof(P);
+    header.indexBytes = sizeof(size_t);
+    header.dimensions = static_cast<uint32_t>(PointTraits<P>::dimensions());
+    header.bucketSize = bucketSize;
+    header.dim = dim;
+    header.size = size;
+    header.nPlaced = nPlaced;
+    header.nErased = nErased;
+    header.nextIndex = nextIndex;
+    header.pointsOffset = tree_file_aligned(sizeof(TreeFileHeader));
+    header.indicesOffset = tree_file_aligned(header.pointsOffset + size * sizeof(P));
+    header.fileBytes = header.indicesOffset + size * sizeof(size_t);
+    if (nErased > 0) {
+        header.erasedOffset = tree_file_aligned(header.fileBytes);
+        header.fileBytes = header.erasedOffset + size;
+    }
+    if (nodesBytes > 0) {
+        header.nodesOffset = tree_file_aligned(header.fileBytes);
+        header.nodesBytes = nodesBytes;
+        header.fileBytes = header.nodesOffset + nodesBytes;
+    }
+    return header;
+}
+
+// the header of the mapped tree file, throwing if it can't be read as a tree of P
+template <typename P>
+TreeFileHeader const& read_tree_file_header(MappedFile const& file)
+{
+    if (file.size() < sizeof(TreeFileHeader))
+        throw std::runtime_error("the file is too small to hold a saved tree");
+
+    TreeFileHeader const& header = *reinterpret_cast<TreeFileHeader const*>(file.data());
+    if (std::memcmp(header.magic, tree_file_magic(), sizeof(header.magic)) != 0)
+        throw std::runtime_error("the file doesn't hold a saved tree");
+    if (header.version != tree_file_version())
+        throw std::runtime_error("the saved tree has an unsupported version");
+    if (header.byteOrder != tree_file_byte_order())
+        throw std::runtime_error("the saved tree has a different byte order");
+    if (header.pointBytes != sizeof(P) || header.indexBytes != sizeof(size_t)
+     || header.dimensions != PointTraits<P>::dimensions())
+        throw std::runtime_error("the saved tree holds a different point type");
+
+    const TreeFileHeader expected = tree_file_header<P>(header.bucketSize, header.dim, header.size, header.nPlaced,
+        header.nErased, header.nextIndex, header.nodesBytes);
+    if (header.nPlaced > header.size || header.nErased > header.size
+     || header.pointsOffset != expected.pointsOffset || header.indicesOffset != expected.indicesOffset
+     || header.erasedOffset != expected.erasedOffset || header.nodesOffset != expected.nodesOffset
+     || header.fileBytes != expected.fileBytes || file.size() < header.fileBytes)
+        throw std::runtime_error("the saved tree is truncated or corrupted");
+
+    return header;
+}
+
+// writes the tree of storage as described by header, nodes being the
+// evaluated subtrees of partially evaluated trees
+template <typename P, typename Storage>
+void write_tree_file(std::ostream& out, Storage const& storage, TreeFileHeader const& header,
+    std::vector<unsigned char> const& nodes = std::vector<unsigned char>())
+{
+    static_assert(std::is_trivially_copyable<P>::value, "only trees of trivially copyable points can be saved");
+
+    const size_t n = storage.size();
+
+    uint64_t written = 0;
+    auto pad_to = [&out, &written](uint64_t offset) {
+        const char zeros[64] = {};
+        out.write(zeros, static_cast<std::streamsize>(offset - written));
+        written = offset;
+    };
+
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    written += sizeof(header);
+
+    pad_to(header.pointsOffset);
+    for (size_t i = 0; i < n; ++i)
+        out.write(reinterpret_cast<char const*>(&storage.point(i)), sizeof(P));
+    written += n * sizeof(P);
+
+    pad_to(header.indicesOffset);
+    for (size_t i = 0; i < n; ++i) {
+        const size_t index = storage.index(i);
+        out.write(reinterpret_cast<char const*>(&index), sizeof(size_t));
+    }
+    written += n * sizeof(size_t);
+
+    if (header.erasedOffset) {
+        pad_to(header.erasedOffset);
+        for (size_t i = 0; i < n; ++i)
+            out.put(storage.is_erased(i) ? 1 : 0);
+        written += n;
+    }
+
+    if (header.nodesOffset) {
+        pad_to(header.nodesOffset);
+        out.write(reinterpret_cast<char const*>(nodes.data()), static_cast<std::streamsize>(nodes.size()));
+    }
+
+    if (!out)
+        throw std::runtime_error("the tree couldn't be written");
+}
+
+// copies of the sections of a saved tree, for trees owning their points
+
+template <typename P>
+std::vector<P> saved_points(MappedFile const& file, TreeFileHeader const& header)
+{
+    P const* points = reinterpret_cast<P const*>(file.data() + header.pointsOffset);
+    return std::vector<P>(points, points + header.size);
+}
+
+inline std::vector<size_t> saved_indices(MappedFile const& file, TreeFileHeader const& header)
+{
+    size_t const* indices = reinterpret_cast<size_t const*>(file.data() + header.indicesOffset);
+    return std::vector<size_t>(indices, indices + header.size);
+}
+
+inline std::vector<bool> saved_erased(MappedFile const& file, TreeFileHeader const& header)
+{
+    if (!header.erasedOffset)
+        return std::vector<bool>();
+
+    char const* erased = file.data() + header.erasedOffset;
+    return std::vector<bool>(erased, erased + header.size);
+}
+
+}
+
+}
+
+#endif // TREEFILE_H
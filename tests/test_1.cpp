@@ -3,11 +3,20 @@
 #define CATCH_CONFIG_MAIN
 #include "../dependencies/Catch.h" //https://github.com/philsquared/Catch
 
+#include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <cstdio>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
 #include <vector>
-#include <chrono> //tmp!
 
 #include "KdTree.h"
+#include "ConcurrentLazyKdTree.h"
+#include "DynamicKdForest.h"
+#include "TraversalStats.h"
 
 using namespace std;
 using namespace lazyTrees;
@@ -48,6 +57,196 @@ public:
 };
 
 
+class Point3Df
+{
+public:
+    float coords[3];
+
+    Point3Df()
+        : coords{ 0.0f, 0.0f, 0.0f }
+    {}
+
+    Point3Df(float x, float y, float z)
+        : coords{ x, y, z }
+    {}
+
+    bool operator ==(const Point3Df &b) const
+    {
+        return coords[0] == b.coords[0] && coords[1] == b.coords[1] && coords[2] == b.coords[2];
+    }
+
+    static constexpr size_t dimensions()
+    {
+        return 3;
+    }
+
+    float operator[](size_t idx) const
+    {
+        return coords[idx];
+    }
+};
+
+struct Point2Di
+{
+    int x, y;
+
+    bool operator ==(const Point2Di &b) const
+    {
+        return x == b.x && y == b.y;
+    }
+
+    static size_t dimensions()
+    {
+        return 2;
+    }
+
+    int operator[](size_t idx) const
+    {
+        return idx == 0 ? x : y;
+    }
+};
+
+struct Point1D
+{
+    double x;
+
+    bool operator ==(const Point1D &b) const
+    {
+        return x == b.x;
+    }
+
+    static size_t dimensions()
+    {
+        return 1;
+    }
+
+    double operator[](size_t) const
+    {
+        return x;
+    }
+};
+
+// a point whose coordinates can't be read while failing is set
+struct FailingPoint2D
+{
+    double x, y;
+    static bool failing;
+
+    bool operator ==(const FailingPoint2D &b) const
+    {
+        return x == b.x && y == b.y;
+    }
+
+    static size_t dimensions()
+    {
+        return 2;
+    }
+
+    double operator[](size_t idx) const
+    {
+        if (failing)
+            throw std::runtime_error("FailingPoint2D can't be accessed");
+        return idx == 0 ? x : y;
+    }
+};
+
+bool FailingPoint2D::failing = false;
+
+
+// the SIMD kernels against the scalar loops for all block sizes, including
+// partial vectors
+template <typename T>
+void compare_kernels_to_scalar()
+{
+    std::mt19937 gen(31);
+    std::uniform_real_distribution<T> dis(T(-10), T(10));
+
+    for (size_t n = 0; n <= detail::SimdBlockSize; ++n) {
+        std::vector<T> coords(n), sqrDists(n), excess(n);
+        for (size_t i = 0; i < n; ++i) {
+            coords[i] = dis(gen);
+            sqrDists[i] = std::fabs(dis(gen));
+            excess[i] = dis(gen);
+        }
+        const T search = dis(gen), halfSize = std::fabs(dis(gen));
+
+        auto expectedSqrDists = sqrDists, expectedExcess = excess;
+        for (size_t i = 0; i < n; ++i) {
+            const T diff = search - coords[i];
+            expectedSqrDists[i] += diff * diff;
+            expectedExcess[i] = std::max(expectedExcess[i], T(std::fabs(search - coords[i])) - halfSize);
+        }
+
+        // one more value, which the kernels must not touch
+        sqrDists.push_back(T(-1));
+        excess.push_back(T(-1));
+        detail::add_square_diffs(sqrDists.data(), coords.data(), search, n);
+        detail::max_box_excess(excess.data(), coords.data(), search, halfSize, n);
+
+        REQUIRE(sqrDists.back() == T(-1));
+        REQUIRE(excess.back() == T(-1));
+        sqrDists.pop_back();
+        excess.pop_back();
+        REQUIRE(sqrDists == expectedSqrDists);
+        REQUIRE(excess == expectedExcess);
+    }
+}
+
+template <size_t BucketSize>
+void compare_to_brute_force()
+{
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+    std::vector<Point2D> pts;
+    for (size_t i = 0; i < 1000; ++i)
+        pts.push_back(Point2D(dis(gen), dis(gen)));
+
+    auto sqrDist = [](Point2D const& a, Point2D const& b) {
+        return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+    };
+
+    LazyKdTree<Point2D, BucketSize> tree(pts);
+    StrictKdTree<Point2D, BucketSize> strictTree(pts);
+
+    for (size_t i = 0; i < 50; ++i) {
+        const Point2D search(dis(gen), dis(gen));
+
+        auto byDistance = pts;
+        std::sort(byDistance.begin(), byDistance.end(), [&](Point2D const& a, Point2D const& b) {
+            return sqrDist(search, a) < sqrDist(search, b);
+        });
+
+        REQUIRE(tree.nearest(search) == byDistance[0]);
+        REQUIRE(strictTree.nearest(search) == byDistance[0]);
+
+        const auto kNearest = tree.k_nearest(search, 10);
+        const auto kNearestStrict = strictTree.k_nearest(search, 10);
+        REQUIRE(kNearest.size() == 10);
+        REQUIRE(kNearestStrict.size() == 10);
+        for (size_t k = 0; k < 10; ++k) {
+            REQUIRE(kNearest[k] == byDistance[k]);
+            REQUIRE(kNearestStrict[k] == byDistance[k]);
+        }
+
+        const size_t nInSphere = std::count_if(pts.begin(), pts.end(), [&](Point2D const& p) {
+            return sqrDist(search, p) <= 20.0 * 20.0;
+        });
+        REQUIRE(tree.in_hypersphere(search, 20.0).size() == nInSphere);
+        REQUIRE(strictTree.in_hypersphere(search, 20.0).size() == nInSphere);
+
+        const size_t nInBox = std::count_if(pts.begin(), pts.end(), [&](Point2D const& p) {
+            return std::fabs(search.x - p.x) <= 10.0 && std::fabs(search.y - p.y) <= 15.0;
+        });
+        REQUIRE(tree.in_box(search, Point2D(20.0, 30.0)).size() == nInBox);
+        REQUIRE(strictTree.in_box(search, Point2D(20.0, 30.0)).size() == nInBox);
+    }
+
+    REQUIRE(tree.size() == pts.size());
+    REQUIRE(strictTree.size() == pts.size());
+}
+
+
 TEST_CASE("KdTree - Point2D") {
     SECTION("Creation and size") {
         auto pts = std::vector<Point2D>{
@@ -116,6 +315,12 @@ TEST_CASE("KdTree - Point2D") {
         REQUIRE(result[1] == Point2D(0.0, 2.0));
         REQUIRE(result[2] == Point2D(0.0, 3.0));
 
+        result = tree.k_nearest(Point2D(0.0, 8.0), 100);
+        REQUIRE(result.size() == 7);
+        REQUIRE(result[0] == Point2D(0.0, 7.0));
+        REQUIRE(result[5] == Point2D(0.0, 1.0));
+        REQUIRE(result[6] == Point2D(15.0, 6.0));
+
         StrictKdTree<Point2D> strictTree(std::move(tree));
         result = strictTree.k_nearest(Point2D(0.0, 0.0), 3);
         REQUIRE(result.size() == 3);
@@ -164,107 +369,1107 @@ TEST_CASE("KdTree - Point2D") {
         REQUIRE(result.size() == 3);
     }
 
-    SECTION("Performance LazyKdTree") { ///@todo move out of test
-        const size_t nPts = 1000000;
+    SECTION("Random points compared to brute force") {
+        compare_to_brute_force<1>();
+    }
+
+    SECTION("Leaf buckets") {
+        compare_to_brute_force<2>();
+        compare_to_brute_force<8>();
+        compare_to_brute_force<32>();
+        compare_to_brute_force<5000>();
+    }
+
+    SECTION("ConcurrentLazyKdTree queried by several threads") {
+        std::mt19937 gen(7);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
         std::vector<Point2D> pts;
-        pts.reserve(nPts);
+        for (size_t i = 0; i < 20000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
 
-        auto tVecStart = std::chrono::high_resolution_clock::now();
-        for (auto i = 0; i < nPts; ++i)
-            pts.push_back(Point2D(0.5 * i, 2.0 * i));
-        std::chrono::duration<double, std::milli> tVec = std::chrono::high_resolution_clock::now() - tVecStart;
+        std::vector<Point2D> searches;
+        for (size_t i = 0; i < 400; ++i)
+            searches.push_back(Point2D(dis(gen), dis(gen)));
 
+        StrictKdTree<Point2D> strictTree(pts);
+        ConcurrentLazyKdTree<Point2D, 4> tree(pts);
 
-        auto tTreeStart = std::chrono::high_resolution_clock::now();
-        LazyKdTree<Point2D> tree(std::move(pts));
-        std::chrono::duration<double, std::milli> tTree = std::chrono::high_resolution_clock::now() - tTreeStart;
+        std::atomic<size_t> nMismatches(0);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 8; ++t) {
+            threads.push_back(std::thread([&, t]() {
+                for (size_t i = t; i < searches.size(); i += 3) {
+                    auto const& search = searches[i];
+                    if (!(tree.nearest(search) == strictTree.nearest(search)))
+                        ++nMismatches;
+                    if (tree.k_nearest(search, 5) != strictTree.k_nearest(search, 5))
+                        ++nMismatches;
+                    if (tree.in_hypersphere(search, 5.0).size() != strictTree.in_hypersphere(search, 5.0).size())
+                        ++nMismatches;
+                    if (tree.in_box(search, Point2D(8.0, 4.0)).size() != strictTree.in_box(search, Point2D(8.0, 4.0)).size())
+                        ++nMismatches;
+                }
+            }));
+        }
+        for (auto& thread : threads)
+            thread.join();
+
+        REQUIRE(nMismatches.load() == 0u);
+
+        tree.ensure_evaluated_fully();
+        REQUIRE(tree.size() == pts.size());
+    }
 
+    SECTION("ConcurrentLazyKdTree unlocks subtrees if evaluating them throws") {
+        std::mt19937 gen(11);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
 
-        auto tNearest1Start = std::chrono::high_resolution_clock::now();
-        auto nearest1 = tree.nearest(Point2D(250000, 1000000));
-        std::chrono::duration<double, std::milli> tNearest1 = std::chrono::high_resolution_clock::now() - tNearest1Start;
+        std::vector<FailingPoint2D> pts;
+        for (size_t i = 0; i < 1000; ++i)
+            pts.push_back(FailingPoint2D{ dis(gen), dis(gen) });
 
+        StrictKdTree<FailingPoint2D> strictTree(pts);
+        ConcurrentLazyKdTree<FailingPoint2D> tree(pts);
+        const FailingPoint2D search{ 1.0, 2.0 };
 
-        auto tNearest2Start = std::chrono::high_resolution_clock::now();
-        auto nearest2 = tree.nearest(Point2D(250000, 1000000));
-        std::chrono::duration<double, std::milli> tNearest2 = std::chrono::high_resolution_clock::now() - tNearest2Start;
+        FailingPoint2D::failing = true;
+        REQUIRE_THROWS(tree.nearest(search));
+        FailingPoint2D::failing = false;
 
-        auto tKNearestStart = std::chrono::high_resolution_clock::now();
-        auto knearest = tree.k_nearest(Point2D(110000, 500000), 1000);
-        std::chrono::duration<double, std::milli> tKNearest = std::chrono::high_resolution_clock::now() - tKNearestStart;
+        // the root would still be marked as busy otherwise, and this would never return
+        REQUIRE(tree.nearest(search) == strictTree.nearest(search));
+        tree.ensure_evaluated_fully(4);
+        REQUIRE(tree.k_nearest(search, 10) == strictTree.k_nearest(search, 10));
+    }
 
-        auto tKNearest2Start = std::chrono::high_resolution_clock::now();
-        auto knearest2 = tree.k_nearest(Point2D(110000, 500000), 1000);
-        std::chrono::duration<double, std::milli> tKNearest2 = std::chrono::high_resolution_clock::now() - tKNearest2Start;
+    SECTION("Parallel evaluation") {
+        std::mt19937 gen(3);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
 
-        auto tSphereStart = std::chrono::high_resolution_clock::now();
-        auto sphere = tree.in_hypersphere(Point2D(20000, 100000), 10000);
-        std::chrono::duration<double, std::milli> tSphere = std::chrono::high_resolution_clock::now() - tSphereStart;
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 200000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
 
-        auto tSphere2Start = std::chrono::high_resolution_clock::now();
-        auto sphere2 = tree.in_hypersphere(Point2D(20000, 100000), 10000);
-        std::chrono::duration<double, std::milli> tSphere2 = std::chrono::high_resolution_clock::now() - tSphere2Start;
+        StrictKdTree<Point2D> sequential(pts);
+        StrictKdTree<Point2D> parallel(pts, 4);
 
-        auto tBoxStart = std::chrono::high_resolution_clock::now();
-        auto box = tree.in_box(Point2D(400000, 400000), Point2D(10000, 10000));
-        std::chrono::duration<double, std::milli> tBox = std::chrono::high_resolution_clock::now() - tBoxStart;
+        LazyKdTree<Point2D, 8> lazy(pts);
+        lazy.nearest(Point2D(1.0, 2.0));
+        lazy.ensure_evaluated_fully(4);
+        REQUIRE(lazy.size() == pts.size());
 
-        auto tBox2Start = std::chrono::high_resolution_clock::now();
-        auto box2 = tree.in_box(Point2D(400000, 400000), Point2D(10000, 10000));
-        std::chrono::duration<double, std::milli> tBox2 = std::chrono::high_resolution_clock::now() - tBox2Start;
+        StrictKdTree<Point2D, 8> fromLazy(std::move(lazy), 3);
 
+        for (size_t i = 0; i < 100; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+            const auto expected = sequential.k_nearest(search, 3);
+            REQUIRE(parallel.k_nearest(search, 3) == expected);
+            REQUIRE(fromLazy.k_nearest(search, 3) == expected);
+        }
+    }
 
-        auto tEvaluateStart = std::chrono::high_resolution_clock::now();
-        tree.ensure_evaluated_fully();
-        std::chrono::duration<double, std::milli> tEvaluate = std::chrono::high_resolution_clock::now() - tEvaluateStart;
+    SECTION("Batch queries") {
+        std::mt19937 gen(11);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 5000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        std::vector<Point2D> searches;
+        for (size_t i = 0; i < 1000; ++i)
+            searches.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4> lazy(pts);
+        StrictKdTree<Point2D, 4> strict(pts);
+        ConcurrentLazyKdTree<Point2D, 4> concurrent(pts);
+
+        std::vector<Point2D> nearest, nearestStrict, nearestConcurrent;
+        lazy.nearest_batch(searches, nearest);
+        strict.nearest_batch(searches, nearestStrict, 4);
+        concurrent.nearest_batch(searches, nearestConcurrent, 4);
+
+        std::vector<std::vector<Point2D> > kNearest, kNearestStrict;
+        lazy.k_nearest_batch(searches, 7, kNearest);
+        strict.k_nearest_batch(searches, 7, kNearestStrict, 4);
+
+        std::vector<std::vector<Point2D> > sphere, box;
+        strict.in_hypersphere_batch(searches, 3.0, sphere, 4);
+        lazy.in_box_batch(searches, Point2D(4.0, 2.0), box);
+
+        REQUIRE(nearest.size() == searches.size());
+        REQUIRE(kNearest.size() == searches.size());
+        for (size_t i = 0; i < searches.size(); ++i) {
+            REQUIRE(nearest[i] == strict.nearest(searches[i]));
+            REQUIRE(nearestStrict[i] == nearest[i]);
+            REQUIRE(nearestConcurrent[i] == nearest[i]);
+            REQUIRE(kNearest[i] == strict.k_nearest(searches[i], 7));
+            REQUIRE(kNearestStrict[i] == kNearest[i]);
+            REQUIRE(sphere[i].size() == strict.in_hypersphere(searches[i], 3.0).size());
+            REQUIRE(box[i].size() == strict.in_box(searches[i], Point2D(4.0, 2.0)).size());
+        }
+
+        strict.k_nearest_batch(searches, 0, kNearestStrict);
+        REQUIRE(kNearestStrict.size() == searches.size());
+        REQUIRE(kNearestStrict[0].empty());
+    }
+
+    SECTION("Batch queries of 1D points") {
+        std::mt19937 gen(13);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point1D> pts, searches;
+        for (size_t i = 0; i < 2000; ++i)
+            pts.push_back(Point1D{ dis(gen) });
+        for (size_t i = 0; i < 500; ++i)
+            searches.push_back(Point1D{ dis(gen) });
+        searches.push_back(Point1D{ -100.0 });
+        searches.push_back(Point1D{ 100.0 });
+
+        LazyKdTree<Point1D, 4> lazy(pts);
+        StrictKdTree<Point1D, 4> strict(pts);
+
+        std::vector<Point1D> nearest;
+        std::vector<std::vector<Point1D> > kNearest;
+        lazy.nearest_batch(searches, nearest);
+        strict.k_nearest_batch(searches, 3, kNearest, 4);
+
+        REQUIRE(nearest.size() == searches.size());
+        for (size_t i = 0; i < searches.size(); ++i) {
+            REQUIRE(nearest[i] == strict.nearest(searches[i]));
+            REQUIRE(kNearest[i] == lazy.k_nearest(searches[i], 3));
+        }
+    }
+
+    SECTION("Index queries") {
+        std::mt19937 gen(5);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 3000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4> lazy(pts);
+        StrictKdTree<Point2D, 4> strict(pts);
+        ConcurrentLazyKdTree<Point2D> concurrent(pts);
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(pts[lazy.nearest_index(search)] == lazy.nearest(search));
+            REQUIRE(pts[strict.nearest_index(search)] == strict.nearest(search));
+            REQUIRE(pts[concurrent.nearest_index(search)] == concurrent.nearest(search));
+
+            const auto kNearest = strict.k_nearest(search, 6);
+            const auto kNearestIndices = lazy.k_nearest_indices(search, 6);
+            REQUIRE(kNearestIndices.size() == kNearest.size());
+            for (size_t k = 0; k < kNearest.size(); ++k)
+                REQUIRE(pts[kNearestIndices[k]] == kNearest[k]);
+
+            const auto sphere = strict.in_hypersphere_indices(search, 10.0);
+            REQUIRE(sphere.size() == lazy.in_hypersphere(search, 10.0).size());
+            for (const auto index : sphere)
+                REQUIRE(std::hypot(pts[index].x - search.x, pts[index].y - search.y) <= 10.0);
+
+            const auto box = concurrent.in_box_indices(search, Point2D(10.0, 10.0));
+            REQUIRE(box.size() == lazy.in_box(search, Point2D(10.0, 10.0)).size());
+            for (const auto index : box)
+                REQUIRE((std::fabs(pts[index].x - search.x) <= 5.0 && std::fabs(pts[index].y - search.y) <= 5.0));
+        }
+
+        // the root of a single bucket is never partitioned
+        LazyKdTree<Point2D, 8> bucket(std::vector<Point2D>{ Point2D(1.0, 1.0), Point2D(2.0, 2.0) });
+        REQUIRE(bucket.nearest_index(Point2D(1.9, 1.9)) == 1);
+        StrictKdTree<Point2D, 8> strictBucket(std::move(bucket));
+        REQUIRE(strictBucket.nearest_index(Point2D(1.1, 1.1)) == 0);
+    }
+
+    SECTION("Selection") {
+        std::mt19937 gen(29);
+        const size_t n = 1000;
+
+        // random, sorted, reversed, organ pipe and constant keys
+        std::vector<std::vector<int> > inputs(5, std::vector<int>(n));
+        for (size_t i = 0; i < n; ++i) {
+            inputs[0][i] = int(gen() % 100);
+            inputs[1][i] = int(i);
+            inputs[2][i] = int(n - i);
+            inputs[3][i] = int(std::min(i, n - i));
+            inputs[4][i] = 7;
+        }
+
+        for (auto const& input : inputs) {
+            for (size_t variant = 0; variant < 2; ++variant) {
+                // the ids are kept in the same order as the keys
+                std::vector<int> keys = input;
+                std::vector<size_t> ids(n);
+                for (size_t i = 0; i < n; ++i)
+                    ids[i] = i;
+                const size_t begin = 10, nth = 400, end = 990;
+
+                auto key = [&keys](size_t i) { return keys[i]; };
+                auto swap = [&keys, &ids](size_t i, size_t j) {
+                    std::swap(keys[i], keys[j]);
+                    std::swap(ids[i], ids[j]);
+                };
+                if (variant == 0)
+                    detail::nth_element_by(begin, nth, end, key, swap);
+                else
+                    detail::nth_element_by_permutation(begin, nth, end, key, swap);
+
+                std::vector<int> expected(input.begin() + begin, input.begin() + end);
+                std::sort(expected.begin(), expected.end());
+                REQUIRE(keys[nth] == expected[nth - begin]);
+                for (size_t i = begin; i < end; ++i)
+                    REQUIRE((i < nth ? keys[i] <= keys[nth] : keys[i] >= keys[nth]));
+                for (size_t i = 0; i < n; ++i) {
+                    REQUIRE(keys[i] == input[ids[i]]);
+                    if (i < begin || i >= end)
+                        REQUIRE(ids[i] == i);
+                }
+            }
+        }
+    }
+
+    SECTION("Visitor queries") {
+        std::mt19937 gen(9);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 3000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4> lazy(pts);
+        StrictKdTree<Point2D> strict(pts);
+
+        const Point2D search(10.0, -20.0);
+        const auto sphere = strict.in_hypersphere(search, 15.0);
+        const auto box = lazy.in_box(search, Point2D(20.0, 10.0));
+        REQUIRE(sphere.size() > 10);
+        REQUIRE(box.size() > 5);
+
+        size_t count = 0;
+        lazy.for_each_in_hypersphere(search, 15.0, [&count](Point2D const&) { ++count; });
+        REQUIRE(count == sphere.size());
+
+        count = 0;
+        strict.for_each_in_box(search, Point2D(20.0, 10.0), [&count](Point2D const&) { ++count; });
+        REQUIRE(count == box.size());
+
+        // returning false stops the search
+        count = 0;
+        strict.for_each_in_hypersphere(search, 15.0, [&count](Point2D const&) { return ++count < 5; });
+        REQUIRE(count == 5);
+
+        count = 0;
+        lazy.for_each_in_box(search, Point2D(20.0, 10.0), [&count](Point2D const&) { ++count; return false; });
+        REQUIRE(count == 1);
+
+        std::vector<Point2D> out;
+        lazy.in_hypersphere(search, 15.0, std::back_inserter(out));
+        REQUIRE(out.size() == sphere.size());
+
+        out.clear();
+        strict.in_box(search, Point2D(20.0, 10.0), std::back_inserter(out));
+        REQUIRE(out.size() == box.size());
+    }
+
+    SECTION("Traversal stats") {
+        std::mt19937 gen(13);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 4000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4, TraversalStats> lazy(pts);
+        StrictKdTree<Point2D, 4, TraversalStats> strict(pts);
+
+        const Point2D search(12.0, 34.0);
+        REQUIRE(lazy.nearest(search) == strict.nearest(search));
+
+        const auto first = lazy.query_stats();
+        REQUIRE(first.nodesVisited > 0);
+        REQUIRE(first.nodesPruned > 0);
+        REQUIRE(first.distanceComputations >= first.nodesVisited);
+        REQUIRE(first.nodesEvaluated > 0);
+        REQUIRE(first.pointsMoved > 0);
+        REQUIRE(first.nodesVisited < pts.size() / 4);
+
+        // the same query again doesn't evaluate anything
+        lazy.nearest(search);
+        REQUIRE(lazy.query_stats().nodesVisited == first.nodesVisited);
+        REQUIRE(lazy.query_stats().nodesEvaluated == 0);
+        REQUIRE(lazy.query_stats().pointsMoved == 0);
+        REQUIRE(lazy.total_stats().nodesVisited == 2 * first.nodesVisited);
+        REQUIRE(lazy.total_stats().nodesEvaluated == first.nodesEvaluated);
+
+        // the strict tree shares the layout, so it traverses the same way
+        REQUIRE(strict.query_stats().nodesVisited == first.nodesVisited);
+        REQUIRE(strict.query_stats().nodesEvaluated == 0);
+
+        lazy.k_nearest(search, 10);
+        REQUIRE(lazy.query_stats().distanceComputations >= 10);
+
+        strict.in_box(search, Point2D(10.0, 10.0));
+        REQUIRE(strict.query_stats().distanceComputations > 0);
+        REQUIRE(strict.total_stats().nodesVisited > first.nodesVisited);
+
+        std::vector<std::vector<Point2D> > results;
+        strict.in_hypersphere_batch(std::vector<Point2D>(300, search), 5.0, results, 4);
+        REQUIRE(results.size() == 300);
+        REQUIRE(strict.query_stats().nodesVisited >= 300);
+
+        strict.reset_stats();
+        REQUIRE(strict.total_stats().nodesVisited == 0);
+
+        lazy.ensure_evaluated_fully(4);
+        const size_t nEvaluated = lazy.total_stats().nodesEvaluated;
+        StrictKdTree<Point2D, 4> fromLazy(std::move(lazy));
+        REQUIRE(nEvaluated > first.nodesEvaluated);
+        REQUIRE(fromLazy.nearest(search) == strict.nearest(search));
+    }
+
+    SECTION("Evaluation coverage") {
+        std::mt19937 gen(17);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 50000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 8> tree(pts);
+        LazyKdTree<Point2D, 8> parallel(pts);
+
+        auto coverage = tree.coverage();
+        REQUIRE(coverage.nodesEvaluated == 0);
+        REQUIRE(coverage.subtreesUnevaluated == 1);
+        REQUIRE(coverage.pointsUnevaluated == pts.size());
+        REQUIRE(coverage.fraction_evaluated(pts.size()) == 0.0);
+        REQUIRE(coverage.bytesUsed >= pts.size() * sizeof(Point2D));
+
+        tree.nearest(Point2D(1.0, 2.0));
+        coverage = tree.coverage();
+        REQUIRE(coverage.nodesEvaluated > 0);
+        REQUIRE(coverage.subtreesUnevaluated > 1);
+        REQUIRE(coverage.pointsUnevaluated < pts.size());
+        REQUIRE(coverage.pointsUnevaluated > pts.size() / 2);
+        REQUIRE(coverage.bytesUnevaluated == coverage.pointsUnevaluated * (sizeof(Point2D) + sizeof(size_t)));
+        REQUIRE(coverage.nodesPerDepth.size() > 1);
+        REQUIRE(coverage.nodesPerDepth[0] == 1);
+
+        size_t nNodes = 0;
+        for (const auto n : coverage.nodesPerDepth)
+            nNodes += n;
+        REQUIRE(nNodes == coverage.nodesEvaluated);
 
-        auto tEvaluate2Start = std::chrono::high_resolution_clock::now();
         tree.ensure_evaluated_fully();
-        std::chrono::duration<double, std::milli> tEvaluate2 = std::chrono::high_resolution_clock::now() - tEvaluate2Start;
-
-
-
-        const std::string logFile("perfLog.csv");
-        std::ifstream fileExistTest(logFile);
-        auto fileExists = (bool)fileExistTest;
-        fileExistTest.close();
-
-        std::ofstream outfile;
-        outfile.open(logFile, std::ios_base::app);
-
-        if (!fileExists)
-        {
-            outfile
-                << "VERSION;"
-                << "vec creation;"
-                << "tree creation;"
-                << "nearest;"
-                << "nearest2;"
-                << "knearest;"
-                << "knearest2;"
-                << "sphere;"
-                << "sphere2;"
-                << "box;"
-                << "box2;"
-                << "full evaluation;"
-                << "full evaluation2;"
-                << std::endl;
+        parallel.nearest(Point2D(1.0, 2.0));
+        parallel.ensure_evaluated_fully(4);
+
+        coverage = tree.coverage();
+        const auto parallelCoverage = parallel.coverage();
+        REQUIRE(coverage.subtreesUnevaluated == 0);
+        REQUIRE(coverage.pointsUnevaluated == 0);
+        REQUIRE(coverage.fraction_evaluated(pts.size()) == 1.0);
+        REQUIRE(parallelCoverage.nodesEvaluated == coverage.nodesEvaluated);
+        REQUIRE(parallelCoverage.nodesPerDepth == coverage.nodesPerDepth);
+        REQUIRE(parallelCoverage.pointsUnevaluated == 0);
+    }
+
+    SECTION("Point traits") {
+        static_assert(PointTraits<Point3Df>::StaticDimensions == 3, "constexpr dimensions are detected");
+        static_assert(PointTraits<Point2D>::StaticDimensions == 0, "runtime dimensions are detected");
+        static_assert(std::is_same<PointTraits<Point3Df>::Distance, float>::value, "float distances");
+        static_assert(std::is_same<PointTraits<Point2Di>::Scalar, int>::value, "int coordinates");
+        static_assert(std::is_same<PointTraits<Point2Di>::Distance, double>::value, "int distances");
+
+        std::mt19937 gen(19);
+        std::uniform_real_distribution<float> dis(-100.0f, 100.0f);
+        std::uniform_int_distribution<int> disInt(-1000, 1000);
+
+        std::vector<Point3Df> pts;
+        std::vector<Point2Di> ptsInt;
+        for (size_t i = 0; i < 2000; ++i) {
+            pts.push_back(Point3Df(dis(gen), dis(gen), dis(gen)));
+            ptsInt.push_back(Point2Di{ disInt(gen), disInt(gen) });
+        }
+
+        LazyKdTree<Point3Df, 4> tree(pts);
+        StrictKdTree<Point2Di> treeInt(ptsInt);
+
+        auto sqrDist = [](Point3Df const& a, Point3Df const& b) {
+            double res = 0.0;
+            for (size_t i = 0; i < 3; ++i)
+                res += (double(a[i]) - b[i]) * (double(a[i]) - b[i]);
+            return res;
+        };
+
+        for (size_t i = 0; i < 30; ++i) {
+            const Point3Df search(dis(gen), dis(gen), dis(gen));
+            const auto best = *std::min_element(pts.begin(), pts.end(), [&](Point3Df const& a, Point3Df const& b) {
+                return sqrDist(search, a) < sqrDist(search, b);
+            });
+            REQUIRE(sqrDist(search, tree.nearest(search)) == Approx(sqrDist(search, best)));
+
+            const Point2Di searchInt{ disInt(gen), disInt(gen) };
+            const size_t nInBox = std::count_if(ptsInt.begin(), ptsInt.end(), [&](Point2Di const& p) {
+                return std::abs(searchInt.x - p.x) <= 100 && std::abs(searchInt.y - p.y) <= 50;
+            });
+            REQUIRE(treeInt.in_box(searchInt, Point2Di{ 200, 100 }).size() == nInBox);
+            REQUIRE(treeInt.k_nearest(searchInt, 5).size() == 5);
+        }
+    }
+
+    SECTION("SIMD kernels") {
+        compare_kernels_to_scalar<double>();
+        compare_kernels_to_scalar<float>();
+    }
+
+    SECTION("SIMD leaf buckets") {
+        std::mt19937 gen(23);
+        std::uniform_real_distribution<float> dis(-10.0f, 10.0f);
+
+        std::vector<Point3Df> pts;
+        for (size_t i = 0; i < 3000; ++i)
+            pts.push_back(Point3Df(dis(gen), dis(gen), dis(gen)));
+
+        // buckets of 1 are scanned without the kernels, the SoA buckets with
+        // them if LAZYTREES_SIMD_BUCKETS is defined, including partial blocks
+        StrictKdTree<Point3Df, 1> scalar(pts);
+        LazyKdTree<Point3Df, 64, NoStats, SoA> simd(pts);
+        LazyKdTree<Point3Df, 37, NoStats, SoA> partial(pts);
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point3Df search(dis(gen), dis(gen), dis(gen));
+            REQUIRE(simd.nearest(search) == scalar.nearest(search));
+            REQUIRE(simd.k_nearest(search, 12) == scalar.k_nearest(search, 12));
+            REQUIRE(partial.k_nearest(search, 12) == scalar.k_nearest(search, 12));
+            REQUIRE(simd.in_hypersphere(search, 2.5).size() == scalar.in_hypersphere(search, 2.5).size());
+            REQUIRE(simd.in_box(search, Point3Df(3.0f, 2.0f, 4.0f)).size() == scalar.in_box(search, Point3Df(3.0f, 2.0f, 4.0f)).size());
+            REQUIRE(partial.in_box(search, Point3Df(3.0f, 2.0f, 4.0f)).size() == scalar.in_box(search, Point3Df(3.0f, 2.0f, 4.0f)).size());
+        }
+    }
+
+    SECTION("SoA storage") {
+        std::mt19937 gen(29);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+        std::uniform_real_distribution<float> disFloat(-100.0f, 100.0f);
+
+        std::vector<Point2D> pts;
+        std::vector<Point3Df> ptsFloat;
+        for (size_t i = 0; i < 5000; ++i) {
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+            ptsFloat.push_back(Point3Df(disFloat(gen), disFloat(gen), disFloat(gen)));
+        }
+
+        StrictKdTree<Point2D, 8> aos(pts);
+        LazyKdTree<Point2D, 8, NoStats, SoA> lazy(pts);
+        StrictKdTree<Point2D, 1, NoStats, SoA> strict(pts, 3);
+        StrictKdTree<Point3Df, 16> aosFloat(ptsFloat);
+        LazyKdTree<Point3Df, 16, NoStats, SoA> lazyFloat(ptsFloat);
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(lazy.nearest(search) == aos.nearest(search));
+            REQUIRE(strict.nearest_index(search) == aos.nearest_index(search));
+            REQUIRE(lazy.k_nearest(search, 9) == aos.k_nearest(search, 9));
+            REQUIRE(strict.k_nearest_indices(search, 9) == aos.k_nearest_indices(search, 9));
+            REQUIRE(lazy.in_hypersphere(search, 8.0).size() == aos.in_hypersphere(search, 8.0).size());
+            REQUIRE(strict.in_box_indices(search, Point2D(9.0, 5.0)).size() == aos.in_box(search, Point2D(9.0, 5.0)).size());
+
+            const Point3Df searchFloat(disFloat(gen), disFloat(gen), disFloat(gen));
+            REQUIRE(lazyFloat.k_nearest(searchFloat, 5) == aosFloat.k_nearest(searchFloat, 5));
+            REQUIRE(lazyFloat.in_box(searchFloat, Point3Df(20.0f, 20.0f, 20.0f)).size()
+                 == aosFloat.in_box(searchFloat, Point3Df(20.0f, 20.0f, 20.0f)).size());
+        }
+
+        // the coordinates are stored on top of the points
+        REQUIRE(lazy.coverage().bytesUsed > pts.size() * (sizeof(Point2D) + 2 * sizeof(double)));
+
+        StrictKdTree<Point2D, 8, NoStats, SoA> fromLazy(std::move(lazy));
+        REQUIRE(fromLazy.nearest(Point2D(1.0, 1.0)) == aos.nearest(Point2D(1.0, 1.0)));
+    }
+
+    SECTION("Node pool") {
+        struct Node { Node* childNegative; Node* childPositive; };
+
+        // nodes are zeroed and never move, even when the pool grows or is moved
+        detail::NodePool<Node> pool;
+        std::vector<Node*> created;
+        for (size_t i = 0; i < 100000; ++i) {
+            created.push_back(pool.create());
+            REQUIRE(created.back()->childNegative == nullptr);
+            created.back()->childPositive = created.front();
+        }
+        detail::NodePool<Node> moved(std::move(pool));
+        REQUIRE(std::all_of(created.begin(), created.end(), [&created](Node const* node) {
+            return node->childPositive == created.front();
+        }));
+        REQUIRE(moved.bytes() >= created.size() * sizeof(Node));
+        REQUIRE(pool.bytes() == 0);
+
+        // evaluated trees keep their nodes when moved
+        std::mt19937 gen(61);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 50000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4, TraversalStats> lazy(pts);
+        lazy.ensure_evaluated_fully(4);
+        LazyKdTree<Point2D, 4, TraversalStats> movedTree(std::move(lazy));
+        movedTree.reset_stats();
+        StrictKdTree<Point2D, 4> strict(pts);
+        for (size_t i = 0; i < 20; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+            REQUIRE(movedTree.nearest_index(search) == strict.nearest_index(search));
+        }
+        REQUIRE(movedTree.total_stats().nodesEvaluated == 0);
+    }
+
+    SECTION("Point views") {
+        std::mt19937 gen(59);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 5000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+        const auto original = pts;
+
+        StrictKdTree<Point2D, 8> aos(pts);
+        LazyKdTree<Point2D, 8, NoStats, View> lazy(PointView<Point2D>(pts), 1);
+        StrictKdTree<Point2D, 4, NoStats, View> strict(PointView<Point2D>(pts.data(), pts.size()), 3);
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(lazy.nearest(search) == aos.nearest(search));
+            REQUIRE(strict.nearest_index(search) == aos.nearest_index(search));
+            REQUIRE(lazy.k_nearest_indices(search, 9) == aos.k_nearest_indices(search, 9));
+            REQUIRE(strict.in_box_indices(search, Point2D(9.0, 5.0)).size() == aos.in_box(search, Point2D(9.0, 5.0)).size());
+            REQUIRE(lazy.in_hypersphere(search, 8.0).size() == aos.in_hypersphere(search, 8.0).size());
+        }
+
+        // only the offsets are stored, the points of the caller are never moved
+        REQUIRE(lazy.coverage().bytesUsed < pts.size() * sizeof(Point2D));
+        REQUIRE(pts == original);
+
+        // erasing only removes offsets
+        auto stripe = [](Point2D const& p) { return p.x >= 10.0 && p.x < 40.0; };
+        const size_t nStripe = std::count_if(pts.begin(), pts.end(), stripe);
+        REQUIRE(lazy.erase_if(stripe) == nStripe);
+        REQUIRE(strict.erase_if(stripe) == nStripe);
+        REQUIRE(lazy.size() == pts.size() - nStripe);
+        REQUIRE(!stripe(lazy.nearest(Point2D(20.0, 0.0))));
+        REQUIRE(!stripe(pts[strict.nearest_index(Point2D(25.0, 0.0))]));
+        REQUIRE(pts == original);
+
+        StrictKdTree<Point2D, 8, NoStats, View> fromLazy(std::move(lazy));
+        REQUIRE(fromLazy.size() == pts.size() - nStripe);
+        REQUIRE(fromLazy.nearest(Point2D(-50.0, 3.0)) == aos.nearest(Point2D(-50.0, 3.0)));
+    }
+
+    SECTION("Approximate nearest neighbors") {
+        std::mt19937 gen(31);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 20000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        auto dist = [](Point2D const& a, Point2D const& b) {
+            return std::hypot(a.x - b.x, a.y - b.y);
+        };
+
+        StrictKdTree<Point2D, 4, TraversalStats> strict(pts);
+        LazyKdTree<Point2D, 4, TraversalStats> exact(pts), approx(pts);
+        ConcurrentLazyKdTree<Point2D> concurrent(pts);
+
+        const double eps = 0.5;
+        for (size_t i = 0; i < 100; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+            const Point2D best = strict.nearest(search);
+            const size_t nVisitedExact = strict.query_stats().nodesVisited;
+
+            // eps = 0 is exact
+            REQUIRE(strict.nearest_approx(search, 0.0) == best);
+            REQUIRE(strict.k_nearest_approx(search, 8, 0.0) == strict.k_nearest(search, 8));
+
+            REQUIRE(dist(search, strict.nearest_approx(search, eps)) <= (1.0 + eps) * dist(search, best));
+            REQUIRE(strict.query_stats().nodesVisited <= nVisitedExact);
+            REQUIRE(dist(search, concurrent.nearest_approx(search, eps)) <= (1.0 + eps) * dist(search, best));
+
+            const auto kExact = strict.k_nearest(search, 8);
+            const auto kApprox = approx.k_nearest_approx(search, 8, eps);
+            REQUIRE(kApprox.size() == 8);
+            for (size_t k = 0; k < 8; ++k)
+                REQUIRE(dist(search, kApprox[k]) <= (1.0 + eps) * dist(search, kExact[k]) + 1e-9);
+
+            exact.k_nearest(search, 8);
+        }
+
+        // approximate searches evaluate less of a lazy tree
+        REQUIRE(approx.total_stats().nodesEvaluated <= exact.total_stats().nodesEvaluated);
+
+        // the budget limits the visited nodes to the primary path and the budget itself
+        strict.nearest_approx(Point2D(0.0, 0.0), 0.0, 3);
+        REQUIRE(strict.query_stats().nodesVisited <= 3 + 20);
+        REQUIRE(strict.k_nearest_approx(Point2D(0.0, 0.0), 3, 0.0, 1).size() >= 1);
+    }
+
+    SECTION("Insertion") {
+        std::mt19937 gen(41);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 2000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        LazyKdTree<Point2D, 4> lazy(pts);
+        LazyKdTree<Point2D, 16, NoStats, SoA> soa(pts);
+        std::vector<Point2D> all = pts;
+
+        bool hadPending = false;
+        for (size_t round = 0; round < 40; ++round) {
+            // clustered as well, so single subtrees overflow
+            std::vector<Point2D> inserted;
+            for (size_t i = 0; i < 100; ++i)
+                inserted.push_back(round % 2 == 0
+                    ? Point2D(dis(gen), dis(gen))
+                    : Point2D(50.0 + 0.01 * dis(gen), 50.0 + 0.01 * dis(gen)));
+
+            lazy.insert(inserted.begin(), inserted.end());
+            for (auto const& p : inserted)
+                soa.insert(p);
+            all.insert(all.end(), inserted.begin(), inserted.end());
+            hadPending = hadPending || lazy.coverage().pointsPending > 0;
+
+            REQUIRE(lazy.size() == all.size());
+
+            StrictKdTree<Point2D, 4> expected(all);
+            for (size_t i = 0; i < 5; ++i) {
+                const Point2D search = i % 2 == 0 ? Point2D(dis(gen), dis(gen)) : Point2D(50.0, 50.0);
+
+                REQUIRE(lazy.nearest(search) == expected.nearest(search));
+                REQUIRE(soa.nearest(search) == expected.nearest(search));
+                REQUIRE(all[lazy.nearest_index(search)] == expected.nearest(search));
+                REQUIRE(lazy.k_nearest(search, 10) == expected.k_nearest(search, 10));
+                REQUIRE(soa.k_nearest(search, 10) == expected.k_nearest(search, 10));
+
+                auto sphere = lazy.in_hypersphere(search, 10.0);
+                auto sphereExpected = expected.in_hypersphere(search, 10.0);
+                REQUIRE(sphere.size() == sphereExpected.size());
+                REQUIRE(std::is_permutation(sphere.begin(), sphere.end(), sphereExpected.begin()));
+
+                auto box = soa.in_box(search, Point2D(20.0, 5.0));
+                auto boxExpected = expected.in_box(search, Point2D(20.0, 5.0));
+                REQUIRE(box.size() == boxExpected.size());
+                REQUIRE(std::is_permutation(box.begin(), box.end(), boxExpected.begin()));
+
+                auto it = lazy.nearest_iterator(search);
+                for (size_t k = 0; k < 10; ++k, ++it)
+                    REQUIRE(*it == expected.k_nearest(search, 10)[k]);
+            }
+        }
+        REQUIRE(hadPending);
+
+        // converting places the inserted points
+        lazy.insert(Point2D(1000.0, 1000.0));
+        REQUIRE(lazy.coverage().pointsPending > 0);
+        StrictKdTree<Point2D, 4> strict(std::move(lazy));
+        REQUIRE(strict.size() == all.size() + 1);
+        REQUIRE(strict.nearest(Point2D(900.0, 900.0)) == Point2D(1000.0, 1000.0));
+        REQUIRE(strict.nearest_index(Point2D(900.0, 900.0)) == all.size());
+
+        // a leaf bucket keeps a bounded number of inserted points, however
+        // few were inserted compared to the size of the tree
+        LazyKdTree<Point2D, 4> bounded(pts);
+        bounded.ensure_evaluated_fully();
+        for (size_t i = 0; i < 8 * 4; ++i)
+            bounded.insert(Point2D(50.0, 50.0));
+        REQUIRE(bounded.coverage().pointsPending == 8 * 4);
+        bounded.insert(Point2D(50.0, 50.0));
+        REQUIRE(bounded.coverage().pointsPending == 0);
+        REQUIRE(bounded.size() == pts.size() + 8 * 4 + 1);
+        REQUIRE(bounded.k_nearest(Point2D(50.0, 50.0), 8 * 4 + 1) == std::vector<Point2D>(8 * 4 + 1, Point2D(50.0, 50.0)));
+
+        // subtrees keeping more inserted points than they have are evaluated
+        LazyKdTree<Point2D, 4> passed(pts);
+        passed.nearest(Point2D(-50.0, -50.0));
+        const size_t nEvaluated = passed.coverage().nodesEvaluated;
+        passed.insert(pts.begin(), pts.end());
+        REQUIRE(passed.coverage().nodesEvaluated > nEvaluated);
+        REQUIRE(passed.coverage().pointsPending == pts.size());
+        const Point2D search(10.0, -20.0);
+        REQUIRE(passed.k_nearest(search, 2) == std::vector<Point2D>(2, StrictKdTree<Point2D>(pts).nearest(search)));
+
+        // points inserted before any query are kept with the root, which
+        // mustn't depend on the address of the tree
+        LazyKdTree<Point2D, 4> unmoved(std::vector<Point2D>(pts.begin(), pts.begin() + 100));
+        unmoved.insert(Point2D(500.0, 500.0));
+        unmoved.insert(Point2D(600.0, 600.0));
+        unmoved.insert(Point2D(700.0, 700.0));
+        REQUIRE(unmoved.coverage().pointsPending == 3);
+
+        auto moved = std::move(unmoved);
+        REQUIRE(moved.size() == 103);
+        REQUIRE(moved.nearest(Point2D(490.0, 490.0)) == Point2D(500.0, 500.0));
+        REQUIRE(moved.in_hypersphere(Point2D(600.0, 600.0), 1.0).size() == 1);
+        REQUIRE(moved.k_nearest(Point2D(800.0, 800.0), 2)[0] == Point2D(700.0, 700.0));
+        REQUIRE(moved.erase(Point2D(600.0, 600.0)) == 1);
+        REQUIRE(moved.erase_if([](Point2D const& p) { return p.x == 700.0; }) == 1);
+        REQUIRE(moved.size() == 101);
+        REQUIRE(moved.nearest(Point2D(800.0, 800.0)) == Point2D(500.0, 500.0));
+    }
+
+    SECTION("Erasing") {
+        std::mt19937 gen(43);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        auto sqrDist = [](Point2D const& a, Point2D const& b) {
+            return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y);
+        };
+
+        // a sliding window, all points ever added are kept for their indices
+        std::vector<Point2D> all;
+        for (size_t i = 0; i < 1000; ++i)
+            all.push_back(Point2D(dis(gen), dis(gen)));
+        std::vector<bool> alive(all.size(), true);
+
+        LazyKdTree<Point2D, 4> lazy(all);
+        LazyKdTree<Point2D, 16, NoStats, SoA> soa(all);
+        StrictKdTree<Point2D, 4> strict(all);
+
+        size_t nAlive = all.size();
+        for (size_t round = 0; round < 20; ++round) {
+            std::vector<Point2D> inserted;
+            for (size_t i = 0; i < 100; ++i)
+                inserted.push_back(Point2D(dis(gen), dis(gen)));
+            lazy.insert(inserted.begin(), inserted.end());
+            soa.insert(inserted.begin(), inserted.end());
+            all.insert(all.end(), inserted.begin(), inserted.end());
+            alive.resize(all.size(), true);
+            nAlive += inserted.size();
+
+            // the points of a stripe expire, some of them just inserted
+            const double xMin = dis(gen), xMax = xMin + 10.0;
+            auto expired = [xMin, xMax](Point2D const& p) { return p.x >= xMin && p.x < xMax; };
+            size_t nExpired = 0;
+            for (size_t i = 0; i < all.size(); ++i) {
+                if (alive[i] && expired(all[i])) {
+                    alive[i] = false;
+                    ++nExpired;
+                }
+            }
+            nAlive -= nExpired;
+
+            REQUIRE(lazy.erase_if(expired) == nExpired);
+            REQUIRE(soa.erase_if(expired) == nExpired);
+            REQUIRE(lazy.size() == nAlive);
+            REQUIRE(soa.size() == nAlive);
+
+            for (size_t i = 0; i < 10; ++i) {
+                const Point2D search(dis(gen), dis(gen));
+
+                size_t best = 0;
+                size_t nInSphere = 0;
+                for (size_t j = 0; j < all.size(); ++j) {
+                    if (!alive[j])
+                        continue;
+                    if (!alive[best] || sqrDist(search, all[j]) < sqrDist(search, all[best]))
+                        best = j;
+                    if (sqrDist(search, all[j]) <= 15.0 * 15.0)
+                        ++nInSphere;
+                }
+
+                REQUIRE(lazy.nearest(search) == all[best]);
+                REQUIRE(soa.nearest_index(search) == best);
+                REQUIRE(lazy.k_nearest(search, 5)[0] == all[best]);
+                REQUIRE(lazy.in_hypersphere(search, 15.0).size() == nInSphere);
+                REQUIRE(soa.in_hypersphere_indices(search, 15.0).size() == nInSphere);
+                REQUIRE(*lazy.nearest_iterator(search) == all[best]);
+            }
+        }
+        REQUIRE(lazy.coverage().pointsErased < lazy.size());
+
+        // erasing single points, including duplicates
+        lazy.insert(all[0]);
+        lazy.insert(all[0]);
+        const size_t nBefore = lazy.size();
+        REQUIRE(lazy.erase(all[0]) == (alive[0] ? 3 : 2));
+        REQUIRE(lazy.erase(all[0]) == 0);
+        REQUIRE(lazy.size() == nBefore - (alive[0] ? 3 : 2));
+
+        // strict trees are built anew once enough points are erased
+        for (size_t i = 0; i < 800; ++i)
+            REQUIRE(strict.erase(all[i]) == 1);
+        REQUIRE(strict.size() == 200);
+        REQUIRE(strict.nearest(all[900]) == all[900]);
+        REQUIRE(strict.nearest_index(all[950]) == 950);
+        REQUIRE(strict.k_nearest(all[0], 1000).size() == 200);
+
+        REQUIRE(strict.erase_if([](Point2D const&) { return true; }) == 200);
+        REQUIRE(strict.size() == 0);
+        REQUIRE(strict.k_nearest(all[0], 10).empty());
+        REQUIRE_THROWS(strict.nearest(all[0]));
+    }
+
+    SECTION("Dynamic forest") {
+        std::mt19937 gen(47);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        DynamicKdForest<Point2D, 4> forest;
+        REQUIRE_THROWS(forest.nearest(Point2D(0.0, 0.0)));
+        REQUIRE(forest.k_nearest(Point2D(0.0, 0.0), 3).empty());
+
+        std::vector<Point2D> all;
+        for (size_t i = 0; i < 1000; ++i) {
+            all.push_back(Point2D(dis(gen), dis(gen)));
+            forest.insert(all.back());
+        }
+
+        // a binary counter of trees
+        REQUIRE(forest.size() == 1000);
+        REQUIRE(forest.tree_count() == 6); // 1000 = 0b1111101000
+
+        std::vector<Point2D> batch;
+        for (size_t i = 0; i < 300; ++i)
+            batch.push_back(Point2D(dis(gen), dis(gen)));
+        forest.insert(batch.begin(), batch.end());
+        all.insert(all.end(), batch.begin(), batch.end());
+
+        StrictKdTree<Point2D, 4> expected(all);
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(forest.nearest(search) == expected.nearest(search));
+            REQUIRE(forest.k_nearest(search, 15) == expected.k_nearest(search, 15));
+
+            auto sphere = forest.in_hypersphere(search, 12.0);
+            auto sphereExpected = expected.in_hypersphere(search, 12.0);
+            REQUIRE(sphere.size() == sphereExpected.size());
+            REQUIRE(std::is_permutation(sphere.begin(), sphere.end(), sphereExpected.begin()));
+
+            REQUIRE(forest.in_box(search, Point2D(10.0, 20.0)).size() == expected.in_box(search, Point2D(10.0, 20.0)).size());
+        }
+
+        REQUIRE(forest.k_nearest(Point2D(0.0, 0.0), 5000).size() == all.size());
+    }
+
+    SECTION("Duplicate points") {
+        std::vector<Point2D> pts(100000, Point2D(1.0, 2.0));
+        pts.push_back(Point2D(5.0, 5.0));
+
+        LazyKdTree<Point2D> lazy(pts);
+        REQUIRE(lazy.nearest(Point2D(4.0, 4.0)) == Point2D(5.0, 5.0));
+        REQUIRE(lazy.k_nearest(Point2D(0.0, 0.0), 10).size() == 10);
+        REQUIRE(lazy.in_hypersphere(Point2D(1.0, 2.0), 0.5).size() == 100000);
+        REQUIRE(lazy.in_box(Point2D(5.0, 5.0), Point2D(1.0, 1.0)).size() == 1);
+
+        lazy.ensure_evaluated_fully();
+        REQUIRE(lazy.coverage().subtreesUnevaluated == 0);
+
+        StrictKdTree<Point2D> strict(std::move(lazy));
+        REQUIRE(strict.nearest(Point2D(0.0, 0.0)) == Point2D(1.0, 2.0));
+    }
+
+    SECTION("Nearest iterator") {
+        std::mt19937 gen(37);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 5000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        auto dist = [](Point2D const& a, Point2D const& b) {
+            return std::hypot(a.x - b.x, a.y - b.y);
+        };
+
+        StrictKdTree<Point2D, 4> strict(pts);
+        LazyKdTree<Point2D, 4, TraversalStats> lazy(pts);
+        ConcurrentLazyKdTree<Point2D> concurrent(pts);
+
+        for (size_t i = 0; i < 20; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+            const auto kNearest = strict.k_nearest(search, 50);
+
+            // the first points are the k nearest ones, in order
+            auto itStrict = strict.nearest_iterator(search);
+            auto itLazy = lazy.nearest_iterator(search);
+            auto itConcurrent = concurrent.nearest_iterator(search);
+            for (size_t k = 0; k < kNearest.size(); ++k, ++itStrict, ++itLazy, ++itConcurrent) {
+                REQUIRE(!itStrict.done());
+                REQUIRE(dist(search, *itStrict) == dist(search, kNearest[k]));
+                REQUIRE(dist(search, *itLazy) == dist(search, kNearest[k]));
+                REQUIRE(dist(search, *itConcurrent) == dist(search, kNearest[k]));
+                REQUIRE(itLazy.distance() == Approx(dist(search, kNearest[k])));
+                REQUIRE(pts[itLazy.index()] == *itLazy);
+            }
+
+            // queries in between don't disturb the iteration
+            lazy.nearest(Point2D(dis(gen), dis(gen)));
+            double previous = itLazy.distance();
+            for (size_t k = 0; k < 50; ++k, ++itLazy) {
+                REQUIRE(itLazy.distance() >= previous);
+                previous = itLazy.distance();
+            }
+        }
+
+        // iterating all points returns each of them once
+        auto sorted = pts;
+        size_t n = 0;
+        for (auto it = strict.nearest_iterator(Point2D(0.0, 0.0)); !it.done(); ++it)
+            sorted[n++] = *it;
+        REQUIRE(n == pts.size());
+        REQUIRE(std::is_permutation(sorted.begin(), sorted.end(), pts.begin()));
+
+        // only the subtrees reached by the iteration are evaluated
+        LazyKdTree<Point2D, 4, TraversalStats> fresh(pts);
+        auto it = fresh.nearest_iterator(Point2D(0.0, 0.0));
+        for (size_t k = 0; k < 10; ++k)
+            ++it;
+        REQUIRE(fresh.coverage().fraction_evaluated(pts.size()) < 0.5);
+        REQUIRE(fresh.total_stats().nodesEvaluated == fresh.coverage().nodesEvaluated);
+    }
+
+    SECTION("Saving and mapping") {
+        std::mt19937 gen(47);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts;
+        for (size_t i = 0; i < 5000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+
+        const std::string path = "test_1_tree.kd";
+        const std::string pathSoA = "test_1_tree_soa.kd";
+        const std::string pathAgain = "test_1_tree_again.kd";
+
+        StrictKdTree<Point2D, 8> strict(LazyKdTree<Point2D, 8>(pts, 1));
+        StrictKdTree<Point2D, 4, NoStats, SoA> soa(pts);
+        strict.erase(pts[7]);
+        strict.save(path);
+        soa.save(pathSoA);
+
+        StrictKdTree<Point2D, 8, NoStats, Mapped> mapped{ MappedFile(path) };
+        StrictKdTree<Point2D, 16, TraversalStats, Mapped> mappedSoA{ MappedFile(pathSoA) };
+        REQUIRE(mapped.size() == pts.size() - 1);
+        REQUIRE(mappedSoA.size() == pts.size());
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(mapped.nearest(search) == strict.nearest(search));
+            REQUIRE(mapped.nearest_index(search) == strict.nearest_index(search));
+            REQUIRE(mapped.k_nearest_indices(search, 9) == strict.k_nearest_indices(search, 9));
+            REQUIRE(mapped.in_box_indices(search, Point2D(9.0, 5.0)) == strict.in_box_indices(search, Point2D(9.0, 5.0)));
+            REQUIRE(mappedSoA.k_nearest_indices(search, 9) == soa.k_nearest_indices(search, 9));
+            REQUIRE(mappedSoA.in_hypersphere(search, 8.0).size() == soa.in_hypersphere(search, 8.0).size());
         }
-        outfile
-            << __DATE__ << " -- " << __TIME__ << ";"
-            << tVec.count() << ";"
-            << tTree.count() << ";"
-            << tNearest1.count() << ";"
-            << tNearest2.count() << ";"
-            << tKNearest.count() << ";"
-            << tKNearest2.count() << ";"
-            << tSphere.count() << ";"
-            << tSphere2.count() << ";"
-            << tBox.count() << ";"
-            << tBox2.count() << ";"
-            << tEvaluate.count() << ";"
-            << tEvaluate2.count()
-            << std::endl;
+        REQUIRE(!(mapped.nearest(pts[7]) == pts[7]));
+
+        // mapped trees can be saved again
+        mapped.save(pathAgain);
+        StrictKdTree<Point2D, 8, NoStats, Mapped> remapped{ MappedFile(pathAgain) };
+        REQUIRE(remapped.size() == mapped.size());
+        REQUIRE(remapped.k_nearest(Point2D(1.0, 1.0), 20) == strict.k_nearest(Point2D(1.0, 1.0), 20));
+
+        // the tree is split less than a smaller BucketSize would require
+        REQUIRE_THROWS((StrictKdTree<Point2D, 4, NoStats, Mapped>(MappedFile(path))));
+        REQUIRE_THROWS((StrictKdTree<Point3Df, 8, NoStats, Mapped>(MappedFile(path))));
+        REQUIRE_THROWS(MappedFile("test_1_missing.kd"));
+
+        std::remove(path.c_str());
+        std::remove(pathSoA.c_str());
+        std::remove(pathAgain.c_str());
     }
 
+    SECTION("Saving lazy trees") {
+        std::mt19937 gen(53);
+        std::uniform_real_distribution<double> dis(-100.0, 100.0);
+
+        std::vector<Point2D> pts, searches;
+        for (size_t i = 0; i < 5000; ++i)
+            pts.push_back(Point2D(dis(gen), dis(gen)));
+        for (size_t i = 0; i < 20; ++i)
+            searches.push_back(Point2D(dis(gen), dis(gen)));
+
+        const std::string path = "test_1_lazy.kd";
+        const std::string pathSoA = "test_1_lazy_soa.kd";
+
+        // partially evaluated, with inserted and erased points
+        LazyKdTree<Point2D, 8> lazy(pts, 1);
+        LazyKdTree<Point2D, 4, NoStats, SoA> soa(pts);
+        for (auto const& search : searches) {
+            lazy.k_nearest(search, 5);
+            soa.nearest(search);
+        }
+        for (size_t i = 0; i < 200; ++i) {
+            const Point2D p(dis(gen), dis(gen));
+            lazy.insert(p);
+            soa.insert(p);
+        }
+        auto stripe = [](Point2D const& p) { return p.x >= 10.0 && p.x < 15.0; };
+        lazy.erase_if(stripe);
+        soa.erase_if(stripe);
+        for (auto const& search : searches)
+            lazy.k_nearest(search, 5);
+        REQUIRE(lazy.coverage().pointsPending > 0);
+        REQUIRE(lazy.coverage().subtreesUnevaluated > 0);
+
+        lazy.save(path);
+        soa.save(pathSoA);
+        LazyKdTree<Point2D, 8, TraversalStats> loaded{ MappedFile(path) };
+        LazyKdTree<Point2D, 4, NoStats, SoA> loadedSoA{ MappedFile(pathSoA) };
+
+        const auto before = lazy.coverage(), after = loaded.coverage();
+        REQUIRE(after.nodesEvaluated == before.nodesEvaluated);
+        REQUIRE(after.subtreesUnevaluated == before.subtreesUnevaluated);
+        REQUIRE(after.pointsUnevaluated == before.pointsUnevaluated);
+        REQUIRE(after.pointsPending == before.pointsPending);
+        REQUIRE(after.pointsErased == before.pointsErased);
+        REQUIRE(after.nodesPerDepth == before.nodesPerDepth);
+        REQUIRE(loaded.size() == lazy.size());
+        REQUIRE(loadedSoA.size() == soa.size());
+
+        // the searches served before don't evaluate anything again
+        for (auto const& search : searches)
+            REQUIRE(loaded.k_nearest(search, 5) == lazy.k_nearest(search, 5));
+        REQUIRE(loaded.total_stats().nodesEvaluated == 0);
+
+        for (size_t i = 0; i < 50; ++i) {
+            const Point2D search(dis(gen), dis(gen));
+
+            REQUIRE(loaded.nearest_index(search) == lazy.nearest_index(search));
+            REQUIRE(loadedSoA.nearest_index(search) == lazy.nearest_index(search));
+            REQUIRE(loaded.k_nearest_indices(search, 9) == lazy.k_nearest_indices(search, 9));
+            REQUIRE(loadedSoA.in_hypersphere(search, 8.0).size() == lazy.in_hypersphere(search, 8.0).size());
+        }
+
+        // the loaded trees keep inserting and erasing like the saved ones
+        lazy.insert(Point2D(12.5, 0.0));
+        loaded.insert(Point2D(12.5, 0.0));
+        REQUIRE(loaded.nearest_index(Point2D(12.5, 0.1)) == lazy.nearest_index(Point2D(12.5, 0.1)));
+        REQUIRE(loaded.erase(pts[0]) == lazy.erase(pts[0]));
+        REQUIRE(loaded.size() == lazy.size());
+
+        // the evaluated subtrees only match the BucketSize they were saved with
+        REQUIRE_THROWS((LazyKdTree<Point2D, 16>(MappedFile(path))));
+        REQUIRE_THROWS((StrictKdTree<Point2D, 8, NoStats, Mapped>(MappedFile(path))));
+
+        // fully evaluated trees are saved like strict ones
+        LazyKdTree<Point2D, 8> full(pts);
+        full.ensure_evaluated_fully();
+        full.save(path);
+        StrictKdTree<Point2D, 8, NoStats, Mapped> mapped{ MappedFile(path) };
+        LazyKdTree<Point2D, 16> fromStrict{ MappedFile(path) };
+        REQUIRE(fromStrict.coverage().subtreesUnevaluated == 0);
+        REQUIRE(mapped.k_nearest(Point2D(1.0, 1.0), 20) == full.k_nearest(Point2D(1.0, 1.0), 20));
+        REQUIRE(fromStrict.k_nearest(Point2D(1.0, 1.0), 20) == full.k_nearest(Point2D(1.0, 1.0), 20));
+
+        std::remove(path.c_str());
+        std::remove(pathSoA.c_str());
+    }
 }